@@ -1,15 +1,22 @@
 #!/bin/bash
 #
-# Extract the root certificate from octopus.energy
+# Extract the root certificates from octopus.energy and api.carbonintensity.org.uk
 
 #set -x
 
-openssl s_client -showcerts -connect octopus.energy:443 </dev/null >hoge
+# getpem <host> <output file>
+getpem()
+{
+openssl s_client -showcerts -connect $1:443 -servername $1 </dev/null >hoge
 
 start=`grep -e "-----BEGIN CERTIFICATE-----" -n hoge | sed -e 's/:.*//g' | tail -n 1`
 
 last=`grep -e "-----END CERTIFICATE-----" -n hoge | sed -e 's/:.*//g' | tail -n 1`
 
-sed -n ${start},${last}p hoge > main/octopus_energy_root_cert.pem
+sed -n ${start},${last}p hoge > $2
 
 rm hoge
+}
+
+getpem octopus.energy main/octopus_energy_root_cert.pem
+getpem api.carbonintensity.org.uk main/carbon_intensity_root_cert.pem
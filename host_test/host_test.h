@@ -0,0 +1,38 @@
+/* Minimal checks for the host tests
+ *
+ * Each test is a plain program: CHECK() reports a failure and carries on, and
+ * host_test_result() gives the exit code for CTest.
+ */
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+
+static int host_test_failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            host_test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+        long long actual_ = (long long)(actual); \
+        long long expected_ = (long long)(expected); \
+        if (actual_ != expected_) { \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_, expected_); \
+            host_test_failures++; \
+        } \
+    } while (0)
+
+static inline int host_test_result(const char * name)
+{
+    if (host_test_failures)
+        fprintf(stderr, "%s: %d checks failed\n", name, host_test_failures);
+    else
+        printf("%s: all checks passed\n", name);
+    return host_test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,176 @@
+/* Protocol traces for both display backends: the anode and segment outputs of the scan
+ * ISR tick by tick, and the words shifted into the MAX7219 chain for known frames.
+ */
+#include <string.h>
+#include "display_encoding.h"
+#include "host_test.h"
+
+static const display_position_t breakaway_layout[] = {
+    { 0, 0 }, { 3, 0 }, { 0, 1 }, { 3, 1 },
+    { DISPLAY_UNUSED, 0 }, { DISPLAY_UNUSED, 0 }, { DISPLAY_UNUSED, 0 }, { DISPLAY_UNUSED, 0 },
+};
+
+static const display_position_t full_layout[] = {
+    { 0, 0 }, { 3, 0 }, { 0, 1 }, { 3, 1 },
+    { 8, 0 }, { 11, 0 }, { 8, 1 }, { 11, 1 },
+};
+
+// A frame with a different pattern on every digit and decimal points on a few
+static void make_test_frame(display_frame_t * frame)
+{
+    for (uint8_t i = 0; i < NUM_OF_ANODES * 2; i++)
+        frame->segments[i] = (i * 37 + 5) & 0x7F;
+    frame->decimal_points = (1u << 1) | (1u << 4) | (1u << 17) | (1u << 31);
+}
+
+static void test_schedule(void)
+{
+    uint8_t schedule[NUM_OF_ANODES];
+    static const uint8_t breakaway_expected[] = { 0, 1, 2, 3, 4, 5 };
+    static const uint8_t full_expected[] = { 0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13 };
+
+    uint8_t length = scanner_schedule_from_layout(breakaway_layout, 8, schedule);
+    CHECK_EQ(length, sizeof(breakaway_expected));
+    CHECK(memcmp(schedule, breakaway_expected, sizeof(breakaway_expected)) == 0);
+
+    length = scanner_schedule_from_layout(full_layout, 8, schedule);
+    CHECK_EQ(length, sizeof(full_expected));
+    CHECK(memcmp(schedule, full_expected, sizeof(full_expected)) == 0);
+}
+
+// Run two whole scan cycles and check every tick's outputs
+static void test_scanner_trace(uint8_t brightness)
+{
+    uint8_t schedule[NUM_OF_ANODES];
+    uint8_t length = scanner_schedule_from_layout(full_layout, 8, schedule);
+    scanner_state_t state = { 0 };
+    scanner_output_t out;
+    display_frame_t frame;
+    uint32_t lit_ticks = 0;
+
+    make_test_frame(&frame);
+    for (uint32_t tick = 0; tick < 2u * length * NUMBER_OF_BRIGHTNESS_SETTINGS; tick++)
+    {
+        uint8_t slot = (tick / NUMBER_OF_BRIGHTNESS_SETTINGS) % length;
+        uint8_t dim_cycle = tick % NUMBER_OF_BRIGHTNESS_SETTINGS;
+        uint8_t anode = schedule[slot];
+
+        scanner_tick(&state, schedule, length, &frame, brightness, &out);
+        CHECK_EQ(out.anode, anode);
+        CHECK_EQ(out.anode_word, 0xFFFF & ~(1u << anode));
+        CHECK_EQ(out.segments[0], frame.segments[anode] | (((frame.decimal_points >> anode) & 1) << 7));
+        CHECK_EQ(out.segments[1], frame.segments[anode + NUM_OF_ANODES] | (((frame.decimal_points >> (anode + NUM_OF_ANODES)) & 1) << 7));
+        // The first ticks of each anode's slot are dark, more of them the dimmer the display
+        CHECK_EQ(out.lit, dim_cycle >= NUMBER_OF_BRIGHTNESS_SETTINGS - 1 - brightness);
+        lit_ticks += out.lit;
+    }
+    CHECK_EQ(lit_ticks, 2u * length * (brightness + 1));
+    CHECK_EQ(state.position, 0);
+    CHECK_EQ(state.dim_cycle, 0);
+}
+
+static void test_max7219_segments(void)
+{
+    CHECK_EQ(max7219_segments(0b00111111, false), 0x7E);     // 0: A to F
+    CHECK_EQ(max7219_segments(0b00000110, false), 0x30);     // 1: B and C
+    CHECK_EQ(max7219_segments(0b01000000, false), 0x01);     // -: G
+    CHECK_EQ(max7219_segments(0, true), 0x80);
+    CHECK_EQ(max7219_segments(0b01111111, true), 0xFF);
+}
+
+static uint16_t digit_word(uint8_t digit, uint8_t value)
+{
+    return ((uint16_t)(MAX7219_REG_DIGIT0 + digit) << 8) | value;
+}
+
+static uint8_t frame_value(const display_frame_t * frame, uint8_t index)
+{
+    return max7219_segments(frame->segments[index], (frame->decimal_points >> index) & 1);
+}
+
+static void test_max7219_frames(void)
+{
+    max7219_state_t state = { .valid = false };
+    max7219_chain_write_t writes[8];
+    display_frame_t frame;
+    uint8_t count;
+
+    CHECK_EQ(MAX7219_CHAIN_LENGTH, 4);
+
+    // The first frame writes every digit register of every chip, furthest chip first
+    make_test_frame(&frame);
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 8);
+    for (uint8_t digit = 0; digit < 8; digit++)
+    {
+        for (uint8_t i = 0; i < MAX7219_CHAIN_LENGTH; i++)
+        {
+            uint8_t chip = MAX7219_CHAIN_LENGTH - 1 - i;
+            CHECK_EQ(writes[digit].words[i], digit_word(digit, frame_value(&frame, chip * 8 + digit)));
+        }
+    }
+
+    // Nothing is sent for an unchanged frame
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 0);
+
+    // One changed digit: digit 10 is chip 1, register digit 2; the other chips get no-ops
+    frame.segments[10] = 0b00000110;
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 1);
+    CHECK_EQ(writes[0].words[0], MAX7219_REG_NOOP << 8);
+    CHECK_EQ(writes[0].words[1], MAX7219_REG_NOOP << 8);
+    CHECK_EQ(writes[0].words[2], digit_word(2, 0x30));
+    CHECK_EQ(writes[0].words[3], MAX7219_REG_NOOP << 8);
+
+    // A decimal point alone counts as a change: digit 31 is chip 3, register digit 7
+    frame.decimal_points &= ~(1u << 31);
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 1);
+    CHECK_EQ(writes[0].words[0], digit_word(7, max7219_segments(frame.segments[31], false)));
+    CHECK_EQ(writes[0].words[3], MAX7219_REG_NOOP << 8);
+
+    // Changes to the same register on different chips share a write; different registers don't
+    frame.segments[0] ^= 1;
+    frame.segments[24] ^= 1;
+    frame.segments[5] ^= 1;
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(writes[0].words[0], digit_word(0, frame_value(&frame, 24)));
+    CHECK_EQ(writes[0].words[1], MAX7219_REG_NOOP << 8);
+    CHECK_EQ(writes[0].words[2], MAX7219_REG_NOOP << 8);
+    CHECK_EQ(writes[0].words[3], digit_word(0, frame_value(&frame, 0)));
+    CHECK_EQ(writes[1].words[0], MAX7219_REG_NOOP << 8);
+    CHECK_EQ(writes[1].words[3], digit_word(5, frame_value(&frame, 5)));
+
+    // After the chips are re-initialised everything is written again
+    state.valid = false;
+    count = max7219_encode_frame(&state, &frame, writes);
+    CHECK_EQ(count, 8);
+}
+
+static void test_max7219_control(void)
+{
+    max7219_chain_write_t write;
+
+    max7219_chain_all(&write, MAX7219_REG_SCAN_LIMIT, 7);
+    for (uint8_t i = 0; i < MAX7219_CHAIN_LENGTH; i++)
+        CHECK_EQ(write.words[i], 0x0B07);
+
+    // Brightness settings spread over the whole intensity range
+    CHECK_EQ(max7219_intensity(0), 0);
+    CHECK_EQ(max7219_intensity(NUMBER_OF_BRIGHTNESS_SETTINGS - 1), MAX7219_MAX_INTENSITY);
+    for (uint8_t brightness = 1; brightness < NUMBER_OF_BRIGHTNESS_SETTINGS; brightness++)
+        CHECK(max7219_intensity(brightness) > max7219_intensity(brightness - 1));
+}
+
+int main(void)
+{
+    test_schedule();
+    for (uint8_t brightness = 0; brightness < NUMBER_OF_BRIGHTNESS_SETTINGS; brightness++)
+        test_scanner_trace(brightness);
+    test_max7219_segments();
+    test_max7219_frames();
+    test_max7219_control();
+    return host_test_result("display_encoding");
+}
@@ -0,0 +1,133 @@
+/* Stress test for the ISR event ring: a producer thread standing in for the ISR and a
+ * consumer thread standing in for the drain task. Both yield rather than spin when they
+ * can't make progress, so the test also finishes quickly on a single core.
+ * Each event carries its sequence number. When the producer retries until there is space,
+ * every event must arrive exactly once and in order, and only the refused puts are counted
+ * as dropped. When it doesn't wait,
+ * as the ISR doesn't, the events that arrive must still be in order and every event must
+ * either arrive or be counted as dropped. Run under -fsanitize=thread to check the memory
+ * ordering as well.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include "isr_event_ring.h"
+#include "host_test.h"
+
+#define EVENTS 2000000
+
+typedef struct {
+    isr_event_ring_t ring;
+    bool wait_for_space;
+    uint32_t refused;               // Puts that found the ring full
+    atomic_int producing;
+} stress_t;
+
+static void * producer_thread(void * arg)
+{
+    stress_t * stress = arg;
+
+    for (uint32_t seq = 0; seq < EVENTS; seq++)
+    {
+        while (!isr_event_ring_put(&stress->ring, seq % 4, seq & 0xFF, seq, ~seq))
+        {
+            stress->refused++;
+            if (!stress->wait_for_space)
+                break;
+            sched_yield();
+        }
+    }
+    atomic_store(&stress->producing, 0);
+    return NULL;
+}
+
+// Drain until the producer is done and the ring is empty, checking each event's contents
+// and that sequence numbers only go up. Returns the number of events received.
+static uint32_t consume(stress_t * stress, uint32_t * out_of_order, uint32_t * corrupt)
+{
+    isr_event_t event;
+    uint32_t received = 0;
+    int64_t last = -1;
+
+    while (true)
+    {
+        bool producing = atomic_load(&stress->producing);
+        if (!isr_event_ring_get(&stress->ring, &event))
+        {
+            if (!producing)
+                break;
+            sched_yield();
+            continue;
+        }
+        if ((int64_t)event.value <= last)
+            (*out_of_order)++;
+        if (event.type != event.value % 4 || event.arg != (event.value & 0xFF) || event.cycles != ~event.value)
+            (*corrupt)++;
+        last = event.value;
+        received++;
+    }
+    return received;
+}
+
+static void run(bool wait_for_space, uint32_t * received, uint32_t * dropped, uint32_t * refused)
+{
+    static stress_t stress;
+    pthread_t producer;
+    uint32_t out_of_order = 0;
+    uint32_t corrupt = 0;
+
+    stress = (stress_t){ .wait_for_space = wait_for_space, .producing = 1 };
+    pthread_create(&producer, NULL, producer_thread, &stress);
+    *received = consume(&stress, &out_of_order, &corrupt);
+    pthread_join(producer, NULL);
+    *dropped = isr_event_ring_dropped(&stress.ring);
+    *refused = stress.refused;
+    CHECK_EQ(out_of_order, 0);
+    CHECK_EQ(corrupt, 0);
+}
+
+static void test_fill_and_drain(void)
+{
+    static isr_event_ring_t ring;
+    isr_event_t event = { 0 };
+
+    // The ring holds exactly ISR_EVENT_RING_SIZE events, the rest are dropped
+    for (uint32_t i = 0; i < ISR_EVENT_RING_SIZE + 3; i++)
+        CHECK(isr_event_ring_put(&ring, 1, 2, i, 0) == (i < ISR_EVENT_RING_SIZE));
+    CHECK_EQ(isr_event_ring_dropped(&ring), 3);
+    for (uint32_t i = 0; i < ISR_EVENT_RING_SIZE; i++)
+    {
+        CHECK(isr_event_ring_get(&ring, &event));
+        CHECK_EQ(event.value, i);
+    }
+    CHECK(!isr_event_ring_get(&ring, &event));
+
+    // Head and tail keep counting past the ring size and wrap around the index
+    for (uint32_t i = 0; i < ISR_EVENT_RING_SIZE * 5 / 2; i++)
+    {
+        CHECK(isr_event_ring_put(&ring, 1, 2, 1000 + i, 0));
+        CHECK(isr_event_ring_get(&ring, &event));
+        CHECK_EQ(event.value, 1000 + i);
+    }
+    CHECK_EQ(isr_event_ring_dropped(&ring), 3);
+}
+
+int main(void)
+{
+    uint32_t received;
+    uint32_t dropped;
+    uint32_t refused;
+
+    test_fill_and_drain();
+
+    run(true, &received, &dropped, &refused);
+    CHECK_EQ(received, EVENTS);
+    CHECK_EQ(dropped, refused);
+    printf("Retrying: %u received, %u puts refused\n", received, refused);
+
+    run(false, &received, &dropped, &refused);
+    CHECK_EQ(received + dropped, EVENTS);
+    CHECK_EQ(dropped, refused);
+    printf("Without retrying: %u received, %u dropped\n", received, dropped);
+
+    return host_test_result("isr_event_ring");
+}
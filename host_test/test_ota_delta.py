@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""Delta OTA updates from ota_server.py: make_delta/apply_delta round trips for changes at
+the start and end of the image, images that grow, shrink or are empty, runs that end exactly
+on the old image's end and inserts split across several operations. Deltas applied to the
+wrong image, truncated at every byte or copying from outside the old image must be rejected,
+as must updates signed with another key or whose signed hash has been changed. Finally the
+update server is run in-process and asked for deltas and full images as a device would.
+
+Needs the openssl command line tool, which ota_server.py uses to sign updates.
+"""
+import argparse
+import os
+import random
+import shutil
+import struct
+import sys
+import tempfile
+import threading
+import unittest
+import urllib.error
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+import ota_server  # noqa: E402
+
+PROJECT = "octopus-unit-rate-display"
+
+
+def random_bytes(rng, length):
+    return bytes(rng.getrandbits(8) for _ in range(length))
+
+
+def app_image(rng, length, project=PROJECT):
+    """An image with the app description fields the server reads, and a unique ELF SHA-256."""
+    image = bytearray(random_bytes(rng, length))
+    name = project.encode().ljust(32, b"\0")
+    image[ota_server.PROJECT_NAME_OFFSET:ota_server.PROJECT_NAME_OFFSET + 32] = name
+    image[ota_server.ELF_SHA256_OFFSET:ota_server.ELF_SHA256_OFFSET + 32] = random_bytes(rng, 32)
+    return bytes(image)
+
+
+def delta_ops(delta):
+    """List the operations of a well formed delta as (op, offset or None, length)."""
+    ops = []
+    pos = ota_server.HEADER_SIZE
+    while True:
+        op = delta[pos:pos + 1]
+        pos += 1
+        if op == b"C":
+            offset, length = struct.unpack_from("<II", delta, pos)
+            ops.append(("C", offset, length))
+            pos += 8
+        elif op == b"I":
+            length, = struct.unpack_from("<I", delta, pos)
+            ops.append(("I", None, length))
+            pos += 4 + length
+        else:
+            ops.append(("E", None, 0))
+            return ops
+
+
+@unittest.skipUnless(shutil.which("openssl"), "openssl is needed to sign updates")
+class OtaDeltaTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.TemporaryDirectory()
+        cls.key = os.path.join(cls.tmp.name, "key.pem")
+        cls.public_key = os.path.join(cls.tmp.name, "public.pem")
+        cls.other_key = os.path.join(cls.tmp.name, "other_key.pem")
+        cls.other_public_key = os.path.join(cls.tmp.name, "other_public.pem")
+        ota_server.keygen(argparse.Namespace(key=cls.key, public_key=cls.public_key))
+        ota_server.keygen(argparse.Namespace(key=cls.other_key, public_key=cls.other_public_key))
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmp.cleanup()
+
+    def setUp(self):
+        self.rng = random.Random(1234)
+
+    def round_trip(self, old, new):
+        delta = ota_server.make_delta(old, new, self.key)
+        self.assertEqual(ota_server.apply_delta(old, delta, self.public_key), new)
+        for op, offset, length in delta_ops(delta):
+            if op == "C":
+                self.assertLessEqual(offset + length, len(old))
+        return delta
+
+    def test_round_trip(self):
+        old = random_bytes(self.rng, 20000)
+        cases = {
+            "identical": old,
+            "changed first byte": bytes([old[0] ^ 1]) + old[1:],
+            "changed last byte": old[:-1] + bytes([old[-1] ^ 1]),
+            "inserted at start": b"new" + old,
+            "appended": old + random_bytes(self.rng, 100),
+            "shorter": old[:12345],
+            "one block": old[640:640 + ota_server.BLOCK],
+            "shorter than a block": old[:ota_server.BLOCK - 1],
+            "moved halves": old[10000:] + old[:10000],
+            "unrelated": random_bytes(self.rng, 5000),
+            "empty": b"",
+        }
+        for name, new in cases.items():
+            with self.subTest(name):
+                self.round_trip(old, new)
+
+    def test_copies_are_used(self):
+        old = random_bytes(self.rng, 20000)
+        new = old[:5000] + b"patched" + old[5000:]
+        delta = self.round_trip(old, new)
+        ops = delta_ops(delta)
+        # A copy up to the change and one from it to the very end of the old image
+        self.assertIn(("C", 0, 5000), ops)
+        self.assertIn(("C", 5000, 15000), ops)
+        self.assertLess(len(delta), 400)
+
+    def test_match_runs_back_into_literal(self):
+        # The first block boundary after the change is well past it, so the copy has to be
+        # extended backwards over bytes that were first taken as literal
+        old = random_bytes(self.rng, 4096)
+        new = bytes([old[0] ^ 1]) + old[1:]
+        ops = delta_ops(self.round_trip(old, new))
+        self.assertEqual(ops[0], ("I", None, 1))
+        self.assertEqual(ops[1], ("C", 1, 4095))
+
+    def test_old_image_edge_cases(self):
+        new = random_bytes(self.rng, 300)
+        for old in (b"", new[:ota_server.BLOCK - 1], new[:ota_server.BLOCK]):
+            with self.subTest(old_length=len(old)):
+                self.round_trip(old, new)
+
+    def test_inserts_split(self):
+        saved = ota_server.MAX_INSERT
+        ota_server.MAX_INSERT = 100
+        try:
+            new = random_bytes(self.rng, 1050)
+            delta = self.round_trip(b"", new)
+        finally:
+            ota_server.MAX_INSERT = saved
+        lengths = [length for op, _, length in delta_ops(delta) if op == "I"]
+        self.assertEqual(lengths, [100] * 10 + [50])
+
+    def test_wrong_source(self):
+        old = random_bytes(self.rng, 5000)
+        delta = ota_server.make_delta(old, old[:2000] + b"x" + old[2000:], self.key)
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(bytes([old[0] ^ 1]) + old[1:], delta)
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old[:4999], delta)
+
+    def test_truncated(self):
+        old = random_bytes(self.rng, 3000)
+        new = old[:1000] + random_bytes(self.rng, 50) + old[1000:]
+        delta = ota_server.make_delta(old, new, self.key)
+        for length in range(len(delta)):
+            with self.subTest(length=length):
+                with self.assertRaises(ValueError):
+                    ota_server.apply_delta(old, delta[:length])
+
+    def test_copy_outside_old_image(self):
+        old = random_bytes(self.rng, 1000)
+        new = old[900:] + old[:900]
+        header = ota_server.make_header(old, new, self.key)
+        for offset, length in ((900, 101), (1000, 1), (0xFFFFFFFF, 2)):
+            with self.subTest(offset=offset, length=length):
+                delta = header + b"C" + struct.pack("<II", offset, length) + b"E"
+                with self.assertRaises(ValueError):
+                    ota_server.apply_delta(old, delta)
+        # Writing past the new image's size
+        delta = header + b"C" + struct.pack("<II", 0, 1000) + b"C" + struct.pack("<II", 0, 1) + b"E"
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old, delta)
+
+    def test_signature(self):
+        old = random_bytes(self.rng, 2000)
+        new = old + b"signed"
+        delta = ota_server.make_delta(old, new, self.key)
+        self.assertEqual(ota_server.apply_delta(old, delta, self.public_key), new)
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old, delta, self.other_public_key)
+        forged = ota_server.make_delta(old, new, self.other_key)
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old, forged, self.public_key)
+        # A signature moved onto another image's hash
+        other = ota_server.make_delta(old, new + b"!", self.key)
+        spliced = other[:80] + delta[80:ota_server.HEADER_SIZE] + other[ota_server.HEADER_SIZE:]
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old, spliced, self.public_key)
+        # An oversized signature length
+        oversized = delta[:76] + struct.pack("<I", ota_server.MAX_SIGNATURE + 1) + delta[80:]
+        with self.assertRaises(ValueError):
+            ota_server.apply_delta(old, oversized)
+
+    def test_full_image(self):
+        new = random_bytes(self.rng, 3000)
+        full = ota_server.make_full(new, self.key)
+        self.assertTrue(all(op != "C" for op, _, _ in delta_ops(full)))
+        # Made against an empty image, so it applies whatever the device is running
+        self.assertEqual(ota_server.apply_delta(b"", full, self.public_key), new)
+        self.assertEqual(ota_server.apply_delta(random_bytes(self.rng, 10), full, self.public_key), new)
+
+    def test_server(self):
+        with tempfile.TemporaryDirectory() as directory:
+            old = app_image(self.rng, 30000)
+            new = bytearray(old)
+            new[ota_server.ELF_SHA256_OFFSET:ota_server.ELF_SHA256_OFFSET + 32] = random_bytes(self.rng, 32)
+            new[20000:20010] = b"0123456789"
+            new = bytes(new)
+            for name, image, mtime in (("old.bin", old, 1000), ("new.bin", new, 2000)):
+                path = os.path.join(directory, name)
+                with open(path, "wb") as f:
+                    f.write(image)
+                os.utime(path, (mtime, mtime))
+
+            server = ota_server.make_server(ota_server.Firmware(directory, self.key), 0)
+            thread = threading.Thread(target=server.serve_forever)
+            thread.start()
+            base = "http://127.0.0.1:%d" % server.server_address[1]
+
+            def get(path):
+                try:
+                    with urllib.request.urlopen(base + path) as response:
+                        return response.status, response.read()
+                except urllib.error.HTTPError as e:
+                    return e.code, b""
+
+            try:
+                old_sha = ota_server.elf_sha256(old)
+                status, delta = get("/delta?project=%s&full=0&from=%s" % (PROJECT, old_sha.upper()))
+                self.assertEqual(status, 200)
+                self.assertEqual(ota_server.apply_delta(old, delta, self.public_key), new)
+                self.assertLess(len(delta), len(new) // 10)
+                # Served again from the cache
+                self.assertEqual(get("/delta?project=%s&full=0&from=%s" % (PROJECT, old_sha)), (200, delta))
+
+                status, full = get("/delta?project=%s&full=1&from=%s" % (PROJECT, "00" * 32))
+                self.assertEqual(status, 200)
+                self.assertEqual(ota_server.apply_delta(b"", full, self.public_key), new)
+
+                self.assertEqual(get("/delta?project=%s&from=%s" % (PROJECT, ota_server.elf_sha256(new)))[0], 204)
+                self.assertEqual(get("/delta?project=%s&from=%s" % (PROJECT, "00" * 32))[0], 404)
+                self.assertEqual(get("/delta?project=other&from=%s" % old_sha)[0], 404)
+                self.assertEqual(get("/firmware.bin")[0], 404)
+            finally:
+                server.shutdown()
+                server.server_close()
+                thread.join()
+
+
+if __name__ == "__main__":
+    unittest.main()
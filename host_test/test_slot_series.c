@@ -0,0 +1,197 @@
+/* Slot series parsing against fixtures in the Agile and carbon intensity API formats, and
+ * the cheapest and greenest window search, including windows at the end of the day and
+ * flat price or intensity ranges.
+ *
+ * fixtures/agile_unit_rates.json: one page of standard-unit-rates, newest first, running
+ * from 2023-11-14T21:00Z to 2023-11-16T22:30Z as seen after the next day's prices are out.
+ * fixtures/carbon_intensity_range.json: /intensity/2023-11-15T00:00Z/2023-11-16T00:30Z,
+ * the range the device asks for. It starts with the 23:30Z slot of the day before and runs
+ * into the next day, so that it includes the 23:30Z slot of the 15th, which /intensity/date
+ * doesn't.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "slot_series.h"
+#include "host_test.h"
+
+#define ALL_SLOTS (((uint64_t)1 << SLOTS_PER_DAY) - 1)
+
+static cJSON * load_fixture(const char * name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", FIXTURES_DIR, name);
+    FILE * file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char * text = calloc(1, length + 1);
+    CHECK(fread(text, 1, length, file) == (size_t)length);
+    fclose(file);
+    cJSON * root = cJSON_Parse(text);
+    free(text);
+    CHECK(root != NULL);
+    return root;
+}
+
+static void test_agile_fixture(cJSON * agile, double * prices, uint64_t * validity)
+{
+    double values[SLOTS_PER_DAY];
+
+    CHECK(parse_slot_series(agile, &agile_series_format, "2023-11-15", prices, validity));
+    CHECK_EQ(*validity, ALL_SLOTS);
+    CHECK(prices[0] == 12.579);      // 00:00
+    CHECK(prices[34] == 37.737);     // 17:00
+    CHECK(prices[47] == 13.1985);    // 23:30
+
+    // The next day's prices stop at 22:30Z; only the last six slots of the day before are there
+    CHECK(parse_slot_series(agile, &agile_series_format, "2023-11-16", values, validity));
+    CHECK_EQ(*validity, ALL_SLOTS >> 2);
+    CHECK(values[45] == 16.17);
+    CHECK(parse_slot_series(agile, &agile_series_format, "2023-11-14", values, validity));
+    CHECK_EQ(*validity, (uint64_t)0x3F << 42);
+    CHECK(values[44] == 16.9575);
+    CHECK(parse_slot_series(agile, &agile_series_format, "2023-11-17", values, validity));
+    CHECK_EQ(*validity, 0);
+
+    // Restore today's validity for the caller
+    parse_slot_series(agile, &agile_series_format, "2023-11-15", prices, validity);
+}
+
+static void test_carbon_intensity_fixture(cJSON * carbon, double * intensities, uint64_t * validity)
+{
+    CHECK(parse_slot_series(carbon, &carbon_intensity_series_format, "2023-11-15", intensities, validity));
+    CHECK_EQ(*validity, ALL_SLOTS);
+    CHECK(intensities[0] == 92);
+    CHECK(intensities[46] == 109);
+    CHECK(intensities[47] == 104);
+    // The agile format doesn't match this response
+    uint64_t other = 1;
+    CHECK(!parse_slot_series(carbon, &agile_series_format, "2023-11-15", intensities, &other));
+    CHECK_EQ(other, 0);
+}
+
+static void test_malformed_entries(void)
+{
+    double values[SLOTS_PER_DAY] = { 0 };
+    uint64_t validity;
+    cJSON * root = cJSON_Parse("{\"results\":["
+        "{\"valid_from\":\"2023-11-15T01:00:00Z\",\"value_inc_vat\":10.5},"
+        "{\"valid_from\":\"2023-11-15T01:30:00Z\",\"value_inc_vat\":null},"     // No value
+        "{\"valid_from\":\"2023-11-15T02\",\"value_inc_vat\":11.0},"             // Too short
+        "{\"valid_from\":\"2023-11-15T24:00:00Z\",\"value_inc_vat\":12.0},"      // Not an hour of the day
+        "{\"valid_from\":\"2023-11-15T03:15:00Z\",\"value_inc_vat\":13.0},"      // Not on a slot boundary
+        "{\"value_inc_vat\":14.0},"                                              // No time
+        "{\"valid_from\":\"2023-11-15T23:30:00Z\",\"value_inc_vat\":-2.5}"       // Negative prices happen
+        "]}");
+
+    CHECK(parse_slot_series(root, &agile_series_format, "2023-11-15", values, &validity));
+    CHECK_EQ(validity, ((uint64_t)1 << 2) | ((uint64_t)1 << 47));
+    CHECK(values[2] == 10.5);
+    CHECK(values[47] == -2.5);
+    cJSON_Delete(root);
+
+    root = cJSON_Parse("{\"detail\":\"Not found.\"}");
+    validity = 1;
+    CHECK(!parse_slot_series(root, &agile_series_format, "2023-11-15", values, &validity));
+    CHECK_EQ(validity, 0);
+    cJSON_Delete(root);
+}
+
+static void test_best_window_fixtures(const double * prices, const double * intensities, uint64_t usable)
+{
+    CHECK_EQ(best_window_find(prices, intensities, usable, 0, 4), 4);
+    CHECK_EQ(usable, ALL_SLOTS);
+    // Later in the day the early window has gone, and the cheapest and greenest one runs
+    // up to the last half-hour of the day
+    CHECK_EQ(best_window_find(prices, intensities, usable, 20, 4), 44);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 44, 3), 45);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 44, 4), 44);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 45, 2), 46);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 46, 2), 46);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 47, 1), 47);
+    CHECK_EQ(best_window_find(prices, intensities, usable, 46, 3), BEST_WINDOW_NONE);
+}
+
+static void test_best_window_synthetic(void)
+{
+    double prices[SLOTS_PER_DAY];
+    double intensities[SLOTS_PER_DAY];
+
+    // Cheapest and greenest at the very end of the day
+    for (uint8_t i = 0; i < SLOTS_PER_DAY; i++)
+    {
+        prices[i] = 30.0 - i * 0.5;
+        intensities[i] = 300.0 - i * 2.0;
+    }
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 4), 44);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 44, 4), 44);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 45, 4), BEST_WINDOW_NONE);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 47, 1), 47);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 48), 0);
+    // A gap in the data breaks up windows
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS & ~((uint64_t)1 << 46), 0, 4), 42);
+    CHECK_EQ(best_window_find(prices, intensities, 0, 0, 4), BEST_WINDOW_NONE);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 0), BEST_WINDOW_NONE);
+
+    // Flat prices: the intensity alone decides
+    for (uint8_t i = 0; i < SLOTS_PER_DAY; i++)
+    {
+        prices[i] = 24.5;
+        intensities[i] = (i >= 20 && i < 24) ? 80.0 : 200.0;
+    }
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 4), 20);
+
+    // Flat intensity: the price alone decides
+    for (uint8_t i = 0; i < SLOTS_PER_DAY; i++)
+    {
+        prices[i] = (i >= 6 && i < 10) ? 5.0 : 25.0;
+        intensities[i] = 150.0;
+    }
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 4), 6);
+
+    // Both flat: every window scores the same and the earliest wins
+    for (uint8_t i = 0; i < SLOTS_PER_DAY; i++)
+    {
+        prices[i] = 24.5;
+        intensities[i] = 150.0;
+    }
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 4), 0);
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 30, 4), 30);
+
+    // Price and intensity pull different ways and carry equal weight after scaling
+    for (uint8_t i = 0; i < SLOTS_PER_DAY; i++)
+    {
+        prices[i] = 20.0;
+        intensities[i] = 200.0;
+    }
+    prices[10] = 0.0;           // Cheapest slot, but dirty
+    intensities[10] = 400.0;
+    prices[30] = 15.0;          // A bit cheaper and the greenest
+    intensities[30] = 0.0;
+    CHECK_EQ(best_window_find(prices, intensities, ALL_SLOTS, 0, 1), 30);
+}
+
+int main(void)
+{
+    double prices[SLOTS_PER_DAY];
+    double intensities[SLOTS_PER_DAY];
+    uint64_t price_validity;
+    uint64_t intensity_validity;
+    cJSON * agile = load_fixture("agile_unit_rates.json");
+    cJSON * carbon = load_fixture("carbon_intensity_range.json");
+
+    test_agile_fixture(agile, prices, &price_validity);
+    test_carbon_intensity_fixture(carbon, intensities, &intensity_validity);
+    test_malformed_entries();
+    test_best_window_fixtures(prices, intensities, price_validity & intensity_validity);
+    test_best_window_synthetic();
+
+    cJSON_Delete(agile);
+    cJSON_Delete(carbon);
+    return host_test_result("slot_series");
+}
@@ -0,0 +1,209 @@
+/* Load test for the SSE fan-out: many subscribers on socket pairs, each drained by its own
+ * reader thread, while the publisher serializes every change once and broadcasts it.
+ * Subscribers come and go from another thread during the run, and one subscriber has
+ * already gone away before the first event. Every remaining subscriber must receive the
+ * identical byte stream.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "sse_fanout.h"
+#include "host_test.h"
+
+#define SUBSCRIBERS 48
+#define CHURN_SUBSCRIBERS 4
+#define CAPACITY (SUBSCRIBERS + CHURN_SUBSCRIBERS + 1)
+#define CHANGES 2000
+#define KEEPALIVE_EVERY 100
+
+typedef struct {
+    int fd;
+    char * received;
+    size_t length;
+    size_t size;
+} reader_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int clients[CAPACITY];
+static sse_fanout_t fanout;
+static int dropped_fd = -1;
+static int drops = 0;
+static atomic_int publishing = 1;
+
+static int socket_send(void * ctx, int fd, const char * data, size_t length)
+{
+    (void)ctx;
+    while (length)
+    {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void socket_drop(void * ctx, int fd)
+{
+    (void)ctx;
+    dropped_fd = fd;
+    drops++;
+}
+
+static void * reader_thread(void * arg)
+{
+    reader_t * reader = arg;
+    char chunk[4096];
+    ssize_t n;
+
+    while ((n = read(reader->fd, chunk, sizeof(chunk))) > 0)
+    {
+        if (reader->length + n > reader->size)
+        {
+            reader->size = (reader->length + n) * 2;
+            reader->received = realloc(reader->received, reader->size);
+        }
+        memcpy(reader->received + reader->length, chunk, n);
+        reader->length += n;
+    }
+    return NULL;
+}
+
+// Subscribers joining and leaving while events are being broadcast; their peers are never read
+static void * churn_thread(void * arg)
+{
+    (void)arg;
+    int churned = 0;
+
+    while (publishing)
+    {
+        int pairs[CHURN_SUBSCRIBERS][2];
+        for (int i = 0; i < CHURN_SUBSCRIBERS; i++)
+        {
+            socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+            pthread_mutex_lock(&lock);
+            CHECK(sse_fanout_add(&fanout, pairs[i][0]));
+            pthread_mutex_unlock(&lock);
+        }
+        usleep(200);
+        for (int i = 0; i < CHURN_SUBSCRIBERS; i++)
+        {
+            pthread_mutex_lock(&lock);
+            CHECK(sse_fanout_remove(&fanout, pairs[i][0]));
+            pthread_mutex_unlock(&lock);
+            close(pairs[i][0]);
+            close(pairs[i][1]);
+        }
+        churned++;
+    }
+    CHECK(churned > 0);
+    return NULL;
+}
+
+// Builds a status frame whose size varies from change to change
+static size_t serialize(char * buffer, size_t size, int version)
+{
+    int n = snprintf(buffer, size, "event: status\ndata: {\"version\":%d,\"agile\":[", version);
+    for (int i = 0; i < 10 + version % 40; i++)
+        n += snprintf(buffer + n, size - n, "%s%d.%02d", i ? "," : "", (version * 7 + i) % 50, i);
+    n += snprintf(buffer + n, size - n, "]}\n\n");
+    return n;
+}
+
+int main(void)
+{
+    static const char keepalive_frame[] = ": keepalive\n\n";
+    static reader_t readers[SUBSCRIBERS];
+    pthread_t reader_threads[SUBSCRIBERS];
+    pthread_t churner;
+    char * expected = NULL;
+    size_t expected_length = 0;
+    char frame[1024];
+    int serializations = 0;
+    int dead[2];
+
+    sse_fanout_init(&fanout, clients, CAPACITY, socket_send, socket_drop, NULL);
+
+    // Subscribed, but gone before the first event
+    socketpair(AF_UNIX, SOCK_STREAM, 0, dead);
+    CHECK(sse_fanout_add(&fanout, dead[0]));
+    close(dead[1]);
+
+    for (int i = 0; i < SUBSCRIBERS; i++)
+    {
+        int pair[2];
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+        CHECK(sse_fanout_add(&fanout, pair[0]));
+        readers[i].fd = pair[1];
+        pthread_create(&reader_threads[i], NULL, reader_thread, &readers[i]);
+    }
+    pthread_create(&churner, NULL, churn_thread, NULL);
+
+    expected = malloc(CHANGES * sizeof(frame));
+    for (int version = 1; version <= CHANGES; version++)
+    {
+        size_t length;
+        bool is_event = version % KEEPALIVE_EVERY != 0;
+
+        if (is_event)
+        {
+            length = serialize(frame, sizeof(frame), version);
+            serializations++;
+        }
+        else
+        {
+            length = sizeof(keepalive_frame) - 1;
+            memcpy(frame, keepalive_frame, length);
+        }
+        memcpy(expected + expected_length, frame, length);
+        expected_length += length;
+
+        pthread_mutex_lock(&lock);
+        sse_fanout_broadcast(&fanout, frame, length, is_event);
+        pthread_mutex_unlock(&lock);
+    }
+    publishing = 0;
+    pthread_join(churner, NULL);
+
+    // Only the subscriber that had gone away was dropped, on the first broadcast
+    CHECK_EQ(drops, 1);
+    CHECK_EQ(dropped_fd, dead[0]);
+    CHECK_EQ(fanout.count, SUBSCRIBERS);
+    CHECK_EQ(serializations, CHANGES - CHANGES / KEEPALIVE_EVERY);
+    CHECK(fanout.events_sent >= (uint32_t)serializations * SUBSCRIBERS);
+    close(dead[0]);
+
+    // Close the server ends so the readers see end of stream
+    while (fanout.count)
+    {
+        int fd = fanout.clients[0];
+        CHECK(sse_fanout_remove(&fanout, fd));
+        close(fd);
+    }
+    CHECK(!sse_fanout_remove(&fanout, dead[0]));
+
+    for (int i = 0; i < SUBSCRIBERS; i++)
+    {
+        pthread_join(reader_threads[i], NULL);
+        CHECK_EQ(readers[i].length, expected_length);
+        CHECK(readers[i].length == expected_length && memcmp(readers[i].received, expected, expected_length) == 0);
+        close(readers[i].fd);
+        free(readers[i].received);
+    }
+    free(expected);
+
+    // A full list refuses new subscribers
+    for (int fd = 0; fd < CAPACITY; fd++)
+        CHECK(sse_fanout_add(&fanout, 1000 + fd));
+    CHECK(!sse_fanout_add(&fanout, 2000));
+    CHECK_EQ(fanout.count, CAPACITY);
+
+    return host_test_result("sse_fanout");
+}
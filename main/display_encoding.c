@@ -0,0 +1,79 @@
+/* Display encoding - see display_encoding.h
+ *
+ * Copyright (c) 2023 Nick Schollar
+ * Licenced under MIT Licence
+ */
+#include <string.h>
+#include "display_encoding.h"
+
+uint8_t scanner_schedule_from_layout(const display_position_t * layout, uint8_t display_count, uint8_t * schedule)
+{
+    uint32_t anodes_in_use = 0;
+    uint8_t length = 0;
+
+    for (uint8_t display = 0; display < display_count; display++)
+    {
+        if (layout[display].anode != DISPLAY_UNUSED)
+            anodes_in_use |= 0b111 << layout[display].anode;
+    }
+    for (uint8_t anode = 0; anode < NUM_OF_ANODES; anode++)
+    {
+        if ((anodes_in_use >> anode) & 1)
+            schedule[length++] = anode;
+    }
+    return length;
+}
+
+uint8_t max7219_segments(uint8_t segments, bool dp)
+{
+    uint8_t value = dp ? 0x80 : 0;
+    for (uint8_t segment = 0; segment < 7; segment++)
+    {
+        if (segments & (1 << segment))
+            value |= 1 << (6 - segment);
+    }
+    return value;
+}
+
+void max7219_chain_all(max7219_chain_write_t * write, uint8_t reg, uint8_t value)
+{
+    for (uint8_t i = 0; i < MAX7219_CHAIN_LENGTH; i++)
+        write->words[i] = ((uint16_t)reg << 8) | value;
+}
+
+uint8_t max7219_encode_frame(max7219_state_t * state, const display_frame_t * frame, max7219_chain_write_t * writes)
+{
+    uint8_t count = 0;
+
+    // One pass down the chain per digit register, sending no-ops to chips whose digit is unchanged
+    for (uint8_t digit = 0; digit < 8; digit++)
+    {
+        max7219_chain_write_t * write = &writes[count];
+        bool changed = false;
+        for (uint8_t chip = 0; chip < MAX7219_CHAIN_LENGTH; chip++)
+        {
+            uint8_t index = chip * 8 + digit;
+            uint8_t value = max7219_segments(frame->segments[index], (frame->decimal_points >> index) & 1);
+            uint16_t * word = &write->words[MAX7219_CHAIN_LENGTH - 1 - chip];
+            if (state->valid && value == state->digits[index])
+            {
+                *word = MAX7219_REG_NOOP << 8;
+            }
+            else
+            {
+                *word = ((uint16_t)(MAX7219_REG_DIGIT0 + digit) << 8) | value;
+                state->digits[index] = value;
+                changed = true;
+            }
+        }
+        if (changed)
+            count++;
+    }
+    state->valid = true;
+    return count;
+}
+
+uint8_t max7219_intensity(uint8_t brightness)
+{
+    return brightness * MAX7219_MAX_INTENSITY / (NUMBER_OF_BRIGHTNESS_SETTINGS - 1);
+}
@@ -0,0 +1,110 @@
+/* Display encoding
+ *
+ * What the display backends send to the hardware for a composed frame: the scan ISR's
+ * anode and segment outputs for each tick, and the MAX7219 register writes. Kept apart
+ * from the GPIO code and free of ESP-IDF so it can be checked on the host (see host_test).
+ */
+#ifndef DISPLAY_ENCODING_H
+#define DISPLAY_ENCODING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NUM_OF_ANODES 16
+#define NUMBER_OF_BRIGHTNESS_SETTINGS 4
+
+typedef struct {
+    uint8_t segments[NUM_OF_ANODES * 2];    // Segment pattern per digit, bit 0 = A to bit 6 = G
+    uint32_t decimal_points;                // One bit per digit
+} display_frame_t;
+
+// Physical position of a logical display: three consecutive anodes on one bank of segment pins
+typedef struct {
+    uint8_t anode;              // First anode, or DISPLAY_UNUSED
+    uint8_t bank;               // 0 = digits 0 to NUM_OF_ANODES - 1, 1 = the rest
+} display_position_t;
+
+#define DISPLAY_UNUSED 0xFF
+
+/* Scanner: one anode is driven at a time, with the digit on that anode in each bank lit
+ * from the segment pins. Each anode gets NUMBER_OF_BRIGHTNESS_SETTINGS ticks, of which the
+ * first ones are left dark to dim the display.
+ */
+typedef struct {
+    uint8_t position;           // Index into the scan schedule
+    uint8_t dim_cycle;          // Tick within the anode's time slot
+} scanner_state_t;
+
+typedef struct {
+    bool lit;                   // False while the digits are kept dark to dim them
+    uint8_t anode;
+    uint16_t anode_word;        // Shifted into the anode shift register MSB first; only the anode's bit is low
+    uint8_t segments[2];        // Segment pattern for each bank with the decimal point in bit 7
+} scanner_output_t;
+
+// Fill schedule with the anodes used by the layout, in scan order. Returns how many there are.
+uint8_t scanner_schedule_from_layout(const display_position_t * layout, uint8_t display_count, uint8_t * schedule);
+
+// Work out what to drive for this tick and move the state on to the next one.
+// Called from the scan ISR, so always inlined into it.
+static inline __attribute__((always_inline)) void scanner_tick(scanner_state_t * state, const uint8_t * schedule, uint8_t schedule_length,
+    const display_frame_t * frame, uint8_t brightness, scanner_output_t * out)
+{
+    uint8_t anode = schedule[state->position];
+
+    out->lit = state->dim_cycle >= (NUMBER_OF_BRIGHTNESS_SETTINGS - 1 - brightness);
+    out->anode = anode;
+    out->anode_word = (uint16_t)~(1u << anode);
+    out->segments[0] = frame->segments[anode] | (((frame->decimal_points >> anode) & 1) << 7);
+    out->segments[1] = frame->segments[anode + NUM_OF_ANODES] | (((frame->decimal_points >> (anode + NUM_OF_ANODES)) & 1) << 7);
+
+    if (state->dim_cycle < NUMBER_OF_BRIGHTNESS_SETTINGS - 1)
+    {
+        state->dim_cycle++;
+    }
+    else
+    {
+        state->dim_cycle = 0;
+        state->position = (state->position < schedule_length - 1) ? state->position + 1 : 0;
+    }
+}
+
+/* MAX7219: a daisy chain of MAX7219s in no-decode mode. Chip n drives frame digits n*8 to
+ * n*8+7, so the chain covers both banks of NUM_OF_ANODES. Each write to the chain is one
+ * 16-bit word (register << 8 | data) per chip, shifted in furthest chip first and latched
+ * together. Only digit registers that have changed are written; the other chips in the
+ * chain are sent a no-op.
+ */
+#define MAX7219_CHAIN_LENGTH ((NUM_OF_ANODES * 2) / 8)
+#define MAX7219_REG_NOOP 0x00
+#define MAX7219_REG_DIGIT0 0x01
+#define MAX7219_REG_DECODE_MODE 0x09
+#define MAX7219_REG_INTENSITY 0x0A
+#define MAX7219_REG_SCAN_LIMIT 0x0B
+#define MAX7219_REG_SHUTDOWN 0x0C
+#define MAX7219_REG_DISPLAY_TEST 0x0F
+#define MAX7219_MAX_INTENSITY 15
+
+typedef struct {
+    uint16_t words[MAX7219_CHAIN_LENGTH];   // In shift order, furthest chip first
+} max7219_chain_write_t;
+
+typedef struct {
+    uint8_t digits[NUM_OF_ANODES * 2];      // Last value written to each digit register
+    bool valid;                             // False until a whole frame has been written
+} max7219_state_t;
+
+// Convert a segment pattern (bit 0 = A) to the MAX7219 no-decode layout (DP A B C D E F G, MSB first)
+uint8_t max7219_segments(uint8_t segments, bool dp);
+
+// The same register write for every chip
+void max7219_chain_all(max7219_chain_write_t * write, uint8_t reg, uint8_t value);
+
+// Fill writes with the chain writes needed to show frame, at most one per digit register.
+// Returns how many there are; 0 if nothing has changed since the last frame.
+uint8_t max7219_encode_frame(max7219_state_t * state, const display_frame_t * frame, max7219_chain_write_t * writes);
+
+// Intensity register value for a brightness of 0 to NUMBER_OF_BRIGHTNESS_SETTINGS - 1
+uint8_t max7219_intensity(uint8_t brightness);
+
+#endif
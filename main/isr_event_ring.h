@@ -0,0 +1,71 @@
+/* ISR event ring
+ *
+ * A single-producer, single-consumer ring for events reported by an interrupt handler.
+ * The producer only writes slots and advances the head; the consumer only reads slots and
+ * advances the tail. If the ring is full the new event is dropped and counted, so the
+ * producer never waits. Header only, so the put is inlined into the ISR (and so ends up in
+ * IRAM with it), and free of ESP-IDF dependencies so it can be stress tested on the host
+ * (see host_test). Place the ring itself in internal RAM.
+ */
+#ifndef ISR_EVENT_RING_H
+#define ISR_EVENT_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ISR_EVENT_RING_SIZE 64      // Must be a power of two
+
+typedef struct {
+    uint32_t cycles;                // CPU cycle count when the event happened
+    uint32_t value;
+    uint8_t type;
+    uint8_t arg;
+} isr_event_t;
+
+typedef struct {
+    isr_event_t events[ISR_EVENT_RING_SIZE];
+    atomic_uint_fast32_t head;      // Written by the producer only
+    atomic_uint_fast32_t tail;      // Written by the consumer only
+    atomic_uint_fast32_t dropped;   // Written by the producer only
+} isr_event_ring_t;
+
+// Add an event. Returns false, and counts the event as dropped, if the ring is full.
+static inline __attribute__((always_inline)) bool isr_event_ring_put(isr_event_ring_t * ring, uint8_t type, uint8_t arg, uint32_t value, uint32_t cycles)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ISR_EVENT_RING_SIZE)
+    {
+        // Only the producer writes the count, so it doesn't need a read-modify-write
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return false;
+    }
+    isr_event_t * event = &ring->events[head & (ISR_EVENT_RING_SIZE - 1)];
+    event->cycles = cycles;
+    event->value = value;
+    event->type = type;
+    event->arg = arg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Take the oldest event. Returns false if there are none.
+static inline bool isr_event_ring_get(isr_event_ring_t * ring, isr_event_t * event)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+        return false;
+    *event = ring->events[tail & (ISR_EVENT_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Events dropped since start-up because the ring was full
+static inline uint32_t isr_event_ring_dropped(isr_event_ring_t * ring)
+{
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
+
+#endif
@@ -25,14 +25,28 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/ringbuf.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_idf_version.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_app_desc.h"
+#endif
 #include "nvs_flash.h"
 #include "time.h"
+#include <stdarg.h>
+#include <stdatomic.h>
 #include "driver/gpio.h"
 #include "hal/gpio_ll.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_cpu.h"
+#else
+#include "hal/cpu_hal.h"
+#endif
 #include "driver/timer.h"
 #include "driver/adc.h"
 
@@ -40,13 +54,20 @@
 #include "lwip/sys.h"
 
 #include "esp_http_client.h" 
+#include "esp_http_server.h"
 #include "esp_tls.h" 
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
 #include "cJSON.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "display_encoding.h"
+#include "sse_fanout.h"
+#include "slot_series.h"
+#include "isr_event_ring.h"
 
 #define SR_DELAY_US 1
-#define NUM_OF_ANODES 16
-#define ANODES_IN_USE 0b0000000000111111
-//#define ANODES_IN_USE 0b0011111100111111
 
 #define pin_segAR 14
 #define pin_segBR 21
@@ -97,10 +118,12 @@ bool got_elec_tomorrow_unit_rate = false;
 bool got_gas_flex_unit_rate = false;
 bool got_elec_flex_unit_rate = false;
 bool got_elec_agile_unit_rate = false;
+bool got_carbon_intensity = false;
 #define TARIFF_TYPE_TRACKER 0
 #define TARIFF_TYPE_FLEXIBLE 1
 #define TARIFF_TYPE_AGILE 2
 #define TARIFF_TYPE_TRACKER_TOMORROW 3
+#define TARIFF_TYPE_CARBON_INTENSITY 4
 
 double gas_unit_rate = 0.0;
 double elec_unit_rate = 0.0;
@@ -111,10 +134,22 @@ double elec_flex_unit_rate = 0.0;
 double elec_agile_rates[48];
 uint64_t elec_agile_validity = 0;
 uint8_t agile_time = 0;
+// National Grid carbon intensity forecast (gCO2/kWh) for each half-hour slot, same layout as the Agile rates
+double carbon_intensity_forecast[48];
+uint64_t carbon_intensity_validity = 0;
+// First slot of the cheapest and greenest window still to come today, or BEST_WINDOW_NONE
+volatile uint8_t best_window_start = BEST_WINDOW_NONE;
+// Incremented whenever any of the rates above are updated
+volatile uint32_t rate_store_version = 0;
+
+// Health states, matching the self-diagnostics dashes
+#define HEALTH_NO_WIFI 0
+#define HEALTH_NO_TIME 1
+#define HEALTH_NO_PRICES 2
+#define HEALTH_OK 3
 
 #define FETCHER_WDOG_LIMIT_IN_SECONDS (60*15)
 
-#define NUMBER_OF_BRIGHTNESS_SETTINGS 4
 #define BRIGHTNESS_HYSTERESIS 100
 // brightness of the display (0 to 3)
 uint8_t display_brightness = 3;
@@ -155,13 +190,54 @@ static int s_retry_num = 0;
 */
 extern const char octopus_energy_root_cert_pem_start[] asm("_binary_octopus_energy_root_cert_pem_start");
 //extern const char octopus_energy_root_cert_pem_end[]	asm("_binary_octopus_energy_root_cert_pem_end");
+// Root cert for api.carbonintensity.org.uk, extracted the same way by getpem.sh
+// Only embedded when carbon intensity is enabled, so the PEM is only needed then
+#if CONFIG_ESP_CARBON_INTENSITY_ENABLE
+extern const char carbon_intensity_root_cert_pem_start[] asm("_binary_carbon_intensity_root_cert_pem_start");
+#endif
+#define CARBON_INTENSITY_HOST "api.carbonintensity.org.uk"
+// Public key that OTA updates must be signed with, written by ota_server.py keygen
+#if CONFIG_ESP_OTA_ENABLE
+extern const char ota_public_key_pem_start[] asm("_binary_ota_public_key_pem_start");
+extern const char ota_public_key_pem_end[] asm("_binary_ota_public_key_pem_end");
+#endif
 
+// Pick the root cert for the server in url
+const char * root_cert_for_url(const char * url)
+{
+#if CONFIG_ESP_CARBON_INTENSITY_ENABLE
+    if (strstr(url, "://" CARBON_INTENSITY_HOST "/"))
+        return carbon_intensity_root_cert_pem_start;
+#endif
+    return octopus_energy_root_cert_pem_start;
+}
+// Web dashboard, gzipped at build time
+extern const char dashboard_gz_start[] asm("_binary_index_html_gz_start");
+extern const char dashboard_gz_end[] asm("_binary_index_html_gz_end");
 
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+
+// Set the RTC from the value of an HTTP Date header
+void set_time_from_date_header(const char *value)
 {
     struct tm time_struct;
     struct timeval timeval_struct;
     
+    ESP_LOGI(TAG, "Date header found: %s", value);
+    strptime(value, "%a, %d %b %Y %H:%M:%S %Z", &time_struct);
+    ESP_LOGI(TAG, "Time struct written: %d-%d-%d %d:%d:%d", time_struct.tm_year, time_struct.tm_mon, time_struct.tm_mday, time_struct.tm_hour, time_struct.tm_min, time_struct.tm_sec);
+    timeval_struct.tv_sec = mktime(&time_struct);
+    timeval_struct.tv_usec = 0;
+    // tv_sec becomes -1 if mktime failed to convert the time struct into a time value
+    if (timeval_struct.tv_sec > 0)
+    {
+        timeSet = true;
+        ESP_LOGI(TAG, "RTC Seconds Since Epoch: %lld", timeval_struct.tv_sec);
+        ESP_LOGI(TAG, "RTC set, returned: %d", settimeofday(&timeval_struct, NULL));
+    }
+}
+
+esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+{
 	static char *output_buffer;  // Buffer to store response of http request from event handler
 	static int output_len;		 // Stores number of bytes read
 	switch(evt->event_id) {
@@ -178,18 +254,7 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 			ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
             if (strcmp(evt->header_key, "Date") == 0)
             {
-                ESP_LOGI(TAG, "Date header found: %s", evt->header_value);
-                strptime(evt->header_value, "%a, %d %b %Y %H:%M:%S %Z", &time_struct);
-                ESP_LOGI(TAG, "Time struct written: %d-%d-%d %d:%d:%d", time_struct.tm_year, time_struct.tm_mon, time_struct.tm_mday, time_struct.tm_hour, time_struct.tm_min, time_struct.tm_sec);
-                timeval_struct.tv_sec = mktime(&time_struct);
-                timeval_struct.tv_usec = 0;
-                // tv_sec becomes -1 if mktime failed to convert the time struct into a time value
-                if (timeval_struct.tv_sec > 0)
-                {
-                    timeSet = true;
-                    ESP_LOGI(TAG, "RTC Seconds Since Epoch: %lld", timeval_struct.tv_sec);
-                    ESP_LOGI(TAG, "RTC set, returned: %d", settimeofday(&timeval_struct, NULL));
-                }
+                set_time_from_date_header(evt->header_value);
             }
 			break;
 		case HTTP_EVENT_ON_DATA:
@@ -401,7 +466,7 @@ size_t http_client_content_length(char * url)
 		.url = url,
 		.event_handler = _http_event_handler,
 		//.user_data = local_response_buffer,			 // Pass address of local buffer to get response
-		.cert_pem = octopus_energy_root_cert_pem_start,
+		.cert_pem = root_cert_for_url(url),
 	};
 	esp_http_client_handle_t client = esp_http_client_init(&config);
 
@@ -433,7 +498,7 @@ esp_err_t http_client_content_get(char * url, char * response_buffer)
 		.url = url,
 		.event_handler = _http_event_handler,
 		.user_data = response_buffer,			 // Pass address of local buffer to get response
-		.cert_pem = octopus_energy_root_cert_pem_start,
+		.cert_pem = root_cert_for_url(url),
 	};
 	esp_http_client_handle_t client = esp_http_client_init(&config);
     
@@ -477,12 +542,44 @@ void date_string_to_struct_tm(const char *s, struct tm *time_struct)
     time_struct->tm_mon--;
 }
 
+// Find the cheapest and greenest window of CONFIG_ESP_BEST_WINDOW_SLOTS slots from the current
+// slot to the end of the day, using slots with both an Agile price and an intensity forecast
+void best_window_update(void)
+{
+    uint64_t usable = (got_elec_agile_unit_rate && got_carbon_intensity) ? (elec_agile_validity & carbon_intensity_validity) : 0;
+    uint8_t best = best_window_find(elec_agile_rates, carbon_intensity_forecast, usable, agile_time, CONFIG_ESP_BEST_WINDOW_SLOTS);
+    
+    if (best != best_window_start)
+    {
+        if (best == BEST_WINDOW_NONE)
+            ESP_LOGI(TAG, "No cheapest and greenest window left today");
+        else
+            ESP_LOGI(TAG, "Cheapest and greenest window starts %02d:%02d: %.2fp, %.0f gCO2/kWh in its first slot",
+                best / 2, (best % 2) * 30, elec_agile_rates[best], carbon_intensity_forecast[best]);
+    }
+    best_window_start = best;
+}
+
+// Parse a slot series into values and validity, logging what was found
+void parse_slot_series_logged(cJSON * root, const slot_series_format_t * format, const char * date_string, double * values, uint64_t * validity, bool * got_series)
+{
+    if (!parse_slot_series(root, format, date_string, values, validity))
+    {
+        ESP_LOGE(TAG, "item pointer is NULL");
+        return;
+    }
+    ESP_LOGI(TAG, "Array size: %d, %d slots for %s", cJSON_GetArraySize(cJSON_GetObjectItem(root, format->array_key)),
+        __builtin_popcountll(*validity), date_string);
+    // Check for null pointer then set
+    if (got_series)
+        *got_series = true;
+}
+
 // Parse the JSON structure and return the unit rate for the specified date
 void parse_object(cJSON *root, time_t time_now, uint8_t tariff_type, double * agile_rates_ref, uint64_t * agile_validity_ref, bool * got_unit_rate_today, double * unit_rate_today, bool * got_unit_rate_tomorrow, double * unit_rate_tomorrow)
 {
     double price = 0.0;
     double price_tomorrow = 0.0;
-    uint8_t agile_hour = 0;
     cJSON* json_date = NULL;
     cJSON* unit_rate = NULL;
     cJSON* payment_method = NULL;
@@ -602,55 +699,11 @@ void parse_object(cJSON *root, time_t time_now, uint8_t tariff_type, double * ag
     }
     else if (tariff_type == TARIFF_TYPE_AGILE)
     {
-        *agile_validity_ref = 0;
-        cJSON *item = cJSON_GetObjectItem(root,"results");
-        if (item == NULL)
-        {
-            ESP_LOGE(TAG, "item pointer is NULL");
-        }
-        else
-        {
-            ESP_LOGI(TAG, "Array size: %d", cJSON_GetArraySize(item));
-            for (i = 0 ; i < cJSON_GetArraySize(item) ; i++)
-            {
-                cJSON * subitem = cJSON_GetArrayItem(item, i);
-                json_date = cJSON_GetObjectItem(subitem, "valid_from");
-                unit_rate = cJSON_GetObjectItem(subitem, "value_inc_vat");
-                ESP_LOGI(TAG, "from: %s unit rate: %f", json_date->valuestring, unit_rate->valuedouble);
-                
-                // Parse the valid-from string (json_date->valuestring)
-                // Format is YYYY-MM-DDTHH:MM:SSZ
-                // Check that the date part matches today's date, by comparing first 10 characters
-                // with today's date string, because yesterday/tomorrow could be there as well
-                if (strncmp(json_date->valuestring, time_string, 10) == 0)
-                {
-                    price = unit_rate->valuedouble;
-                    // Get hour for current entry from valid-from string
-                    agile_hour = (json_date->valuestring[11] - 48 ) * 10 + (json_date->valuestring[12] - 48);
-                    // Put the prices into the array
-                    // 00:00 agile_rates_ref[0]
-                    // 00:30 agile_rates_ref[1]
-                    // 01:00 agile_rates_ref[2]
-                    // and so on
-                    if (agile_hour <= 23)
-                    {
-                        if (json_date->valuestring[14] == '0')
-                        {
-                            agile_rates_ref[agile_hour * 2] = price;
-                            *agile_validity_ref |= ((uint64_t)1 << (agile_hour * 2));
-                        }
-                        else if (json_date->valuestring[14] == '3')
-                        {
-                            agile_rates_ref[agile_hour * 2 + 1] = price;
-                            *agile_validity_ref |= ((uint64_t)1 << (agile_hour * 2 + 1));
-                        }
-                    }
-                }
-            }
-            // Check for null pointer then set
-            if (got_unit_rate_today)
-                *got_unit_rate_today = true;
-        }
+        parse_slot_series_logged(root, &agile_series_format, time_string, agile_rates_ref, agile_validity_ref, got_unit_rate_today);
+    }
+    else if (tariff_type == TARIFF_TYPE_CARBON_INTENSITY)
+    {
+        parse_slot_series_logged(root, &carbon_intensity_series_format, time_string, agile_rates_ref, agile_validity_ref, got_unit_rate_today);
     }
     if (unit_rate_today)
         *unit_rate_today = price;
@@ -658,41 +711,282 @@ void parse_object(cJSON *root, time_t time_now, uint8_t tariff_type, double * ag
         *unit_rate_tomorrow = price_tomorrow;
 }
 
-void http_client(char * url, uint8_t tariff_type, double * agile_rates_ref, uint64_t * agile_validity_ref, bool * got_unit_rate, double * unit_rate, bool * got_tracker_tomorrow_rate, double * tracker_tomorrow_rate)
+/* Freshness tracking
+ *
+ * For each tariff this records when new data was first parsed and when it first reached a
+ * frame given to the display backend. Publication times aren't known, so the time since the
+ * source was last checked without finding anything new is used as an upper bound on how
+ * long the data had been published before it was seen.
+ *
+ * The display's availability is sampled every frame as valid, dashes (a rate can't be shown)
+ * or stale (showing a Tracker rate parsed on an earlier day). Time in each state and the
+ * length of each episode are kept per UTC day, and the previous day is logged as a summary.
+ *
+ * Histograms are log2 scale: bucket n counts values from 2^(n-1) up to 2^n - 1, bucket 0 counts zeros.
+ */
+static const char *TAG_FRESH = "FRESH";
+
+#define FRESHNESS_HISTOGRAM_BUCKETS 20
+
+#define FRESHNESS_TRACKER_ELEC 0
+#define FRESHNESS_TRACKER_GAS 1
+#define FRESHNESS_FLEX_ELEC 2
+#define FRESHNESS_FLEX_GAS 3
+#define FRESHNESS_AGILE_ELEC 4
+#define FRESHNESS_CARBON_INTENSITY 5
+#define NUM_OF_FRESHNESS_TARIFFS 6
+
+#define AVAILABILITY_VALID 0
+#define AVAILABILITY_DASHES 1
+#define AVAILABILITY_STALE 2
+#define NUM_OF_AVAILABILITY_STATES 3
+
+// What a parse gave, kept to tell new data from a repeat of what was already seen
+typedef struct {
+    bool got_today;
+    double today;
+    bool got_tomorrow;          // Tracker only
+    double tomorrow;
+    bool is_series;             // Agile prices and carbon intensity: half-hourly slots for today
+    uint64_t validity;
+    uint32_t values_hash;
+} freshness_data_t;
+
+typedef struct {
+    const char * name;
+    bool * got_ref;             // Identifies the tariff by where its rates are stored
+    bool has_data;              // False until the first parse
+    freshness_data_t data;      // From the last parse; unlike the rate store, not cleared at midnight
+    time_t last_checked;        // Last time the source was checked without finding anything new
+    time_t first_seen;          // When the latest new data was first parsed
+    time_t displayed;           // When it first reached a frame
+    int64_t pending_us;         // When data not yet in a frame was parsed, 0 if none
+    int data_yday;              // UTC day of the last parse, -1 if never parsed
+    uint32_t updates;
+    uint32_t discovery_histogram[FRESHNESS_HISTOGRAM_BUCKETS];  // Seconds since the previous check when new data was seen
+    uint32_t frame_histogram[FRESHNESS_HISTOGRAM_BUCKETS];      // Milliseconds from parse to frame
+} freshness_tariff_t;
+
+typedef struct {
+    int yday;
+    uint64_t state_us[NUM_OF_AVAILABILITY_STATES];
+    uint32_t episodes[NUM_OF_AVAILABILITY_STATES];
+    uint32_t episode_histogram[NUM_OF_AVAILABILITY_STATES][FRESHNESS_HISTOGRAM_BUCKETS];   // Seconds
+} freshness_day_t;
+
+static const char *availability_state_names[] = { "valid", "dashes", "stale" };
+
+static freshness_tariff_t freshness_tariffs[NUM_OF_FRESHNESS_TARIFFS] = {
+    { .name = "tracker_elec", .got_ref = &got_elec_unit_rate, .data_yday = -1 },
+    { .name = "tracker_gas", .got_ref = &got_gas_unit_rate, .data_yday = -1 },
+    { .name = "flex_elec", .got_ref = &got_elec_flex_unit_rate, .data_yday = -1 },
+    { .name = "flex_gas", .got_ref = &got_gas_flex_unit_rate, .data_yday = -1 },
+    { .name = "agile_elec", .got_ref = &got_elec_agile_unit_rate, .data_yday = -1 },
+    { .name = "carbon_intensity", .got_ref = &got_carbon_intensity, .data_yday = -1 },
+};
+static freshness_day_t freshness_today = { .yday = -1 };
+static freshness_day_t freshness_yesterday = { .yday = -1 };
+static uint8_t availability_state = AVAILABILITY_DASHES;
+static int64_t availability_since_us = 0;
+static int64_t availability_sampled_us = 0;
+static portMUX_TYPE freshness_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint8_t freshness_bucket(uint64_t value)
+{
+    uint8_t bucket = 0;
+    while (value && bucket < FRESHNESS_HISTOGRAM_BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+freshness_tariff_t * freshness_tariff_for(const bool * got_ref)
+{
+    for (uint8_t i = 0; i < NUM_OF_FRESHNESS_TARIFFS; i++)
+    {
+        if (freshness_tariffs[i].got_ref == got_ref)
+            return &freshness_tariffs[i];
+    }
+    return NULL;
+}
+
+// The source was checked and had nothing new (a probe found no results)
+void freshness_record_check(const bool * got_ref)
+{
+    freshness_tariff_t * t = freshness_tariff_for(got_ref);
+    if (!t)
+        return;
+    portENTER_CRITICAL(&freshness_lock);
+    t->last_checked = time(NULL);
+    portEXIT_CRITICAL(&freshness_lock);
+}
+
+// Hash of the valid slots of a half-hourly series
+uint32_t freshness_series_hash(const double * values, uint64_t validity)
+{
+    uint32_t hash = 2166136261u;    // FNV-1a
+    for (uint8_t i = 0; i < 48; i++)
+    {
+        if (!((validity >> i) & 1))
+            continue;
+        const uint8_t * bytes = (const uint8_t *)&values[i];
+        for (uint8_t b = 0; b < sizeof(double); b++)
+            hash = (hash ^ bytes[b]) * 16777619u;
+    }
+    return hash;
+}
+
+// Whether a parse gave data that hasn't been seen before, compared with the previous parse
+bool freshness_is_new(const freshness_tariff_t * t, const freshness_data_t * data, int yday)
+{
+    const freshness_data_t * last = &t->data;
+    if (!t->has_data)
+        return true;
+    // A new day's series was published the day before, so only a change during the day is news
+    if (data->is_series)
+        return yday == t->data_yday && (data->validity != last->validity || data->values_hash != last->values_hash);
+    // Yesterday's tomorrow rate becoming today's rate isn't news either
+    bool today_new = data->got_today && (!last->got_today || data->today != last->today)
+        && !(yday != t->data_yday && last->got_tomorrow && data->today == last->tomorrow);
+    bool tomorrow_new = data->got_tomorrow && (!last->got_tomorrow || data->tomorrow != last->tomorrow);
+    return today_new || tomorrow_new;
+}
+
+// A full response was parsed and gave data
+void freshness_record_parse(const bool * got_ref, const freshness_data_t * data)
+{
+    freshness_tariff_t * t = freshness_tariff_for(got_ref);
+    if (!t || !timeSet)
+        return;
+    time_t time_now = time(NULL);
+    struct tm time_struct;
+    gmtime_r(&time_now, &time_struct);
+    uint32_t discovery_s = 0;
+    
+    portENTER_CRITICAL(&freshness_lock);
+    bool changed = freshness_is_new(t, data, time_struct.tm_yday);
+    t->data = *data;
+    t->has_data = true;
+    t->data_yday = time_struct.tm_yday;
+    if (changed)
+    {
+        discovery_s = t->last_checked ? time_now - t->last_checked : 0;
+        if (t->last_checked)
+            t->discovery_histogram[freshness_bucket(discovery_s)]++;
+        t->updates++;
+        t->first_seen = time_now;
+        if (!t->pending_us)
+            t->pending_us = esp_timer_get_time();
+    }
+    t->last_checked = time_now;
+    portEXIT_CRITICAL(&freshness_lock);
+    
+    if (changed)
+        ESP_LOGI(TAG_FRESH, "New %s data seen, at most %lu s after it was published", t->name, discovery_s);
+}
+
+// A frame composed from the current rates has been taken by the display backend.
+// drawn has a bit set (1 << FRESHNESS_*) for each tariff whose rates are in the frame.
+void freshness_record_frame(uint8_t drawn)
+{
+    int64_t now_us = esp_timer_get_time();
+    time_t time_now = time(NULL);
+    
+    for (uint8_t i = 0; i < NUM_OF_FRESHNESS_TARIFFS; i++)
+    {
+        freshness_tariff_t * t = &freshness_tariffs[i];
+        int64_t latency_ms = -1;
+        if (!((drawn >> i) & 1))
+            continue;
+        portENTER_CRITICAL(&freshness_lock);
+        if (t->pending_us)
+        {
+            latency_ms = (now_us - t->pending_us) / 1000;
+            t->frame_histogram[freshness_bucket(latency_ms)]++;
+            t->displayed = time_now;
+            t->pending_us = 0;
+        }
+        portEXIT_CRITICAL(&freshness_lock);
+        if (latency_ms >= 0)
+            ESP_LOGI(TAG_FRESH, "New %s data reached the display %lld ms after parsing", t->name, latency_ms);
+    }
+}
+
+void freshness_log_day(const freshness_day_t * day)
+{
+    ESP_LOGI(TAG_FRESH, "Day %d summary: valid %llu min (%lu episodes), dashes %llu min (%lu episodes), stale %llu min (%lu episodes)", day->yday,
+        day->state_us[AVAILABILITY_VALID] / 60000000, day->episodes[AVAILABILITY_VALID],
+        day->state_us[AVAILABILITY_DASHES] / 60000000, day->episodes[AVAILABILITY_DASHES],
+        day->state_us[AVAILABILITY_STALE] / 60000000, day->episodes[AVAILABILITY_STALE]);
+    for (uint8_t i = 0; i < NUM_OF_FRESHNESS_TARIFFS; i++)
+    {
+        const freshness_tariff_t * t = &freshness_tariffs[i];
+        if (t->updates)
+            ESP_LOGI(TAG_FRESH, "%s: %lu updates, last seen %lld, displayed %lld", t->name, t->updates, (long long)t->first_seen, (long long)t->displayed);
+    }
+}
+
+// Sample the display's availability; called once per composed frame
+void freshness_record_availability(bool all_rates_shown)
+{
+    int64_t now_us = esp_timer_get_time();
+    uint8_t state = AVAILABILITY_VALID;
+    int yday = -1;
+    bool new_day = false;
+    
+    if (timeSet)
+    {
+        time_t time_now = time(NULL);
+        struct tm time_struct;
+        gmtime_r(&time_now, &time_struct);
+        yday = time_struct.tm_yday;
+    }
+    
+    portENTER_CRITICAL(&freshness_lock);
+    if (!all_rates_shown)
+        state = AVAILABILITY_DASHES;
+    else if ((freshness_tariffs[FRESHNESS_TRACKER_ELEC].data_yday != yday) || (freshness_tariffs[FRESHNESS_TRACKER_GAS].data_yday != yday))
+        state = AVAILABILITY_STALE;
+    
+    if (availability_sampled_us)
+        freshness_today.state_us[availability_state] += now_us - availability_sampled_us;
+    availability_sampled_us = now_us;
+    if (state != availability_state || !availability_since_us)
+    {
+        if (availability_since_us)
+        {
+            freshness_today.episodes[availability_state]++;
+            freshness_today.episode_histogram[availability_state][freshness_bucket((now_us - availability_since_us) / 1000000)]++;
+        }
+        availability_state = state;
+        availability_since_us = now_us;
+    }
+    // Start a new day once the time is known; time before that counts towards the first day
+    if (yday >= 0 && yday != freshness_today.yday)
+    {
+        new_day = (freshness_today.yday >= 0);
+        if (new_day)
+        {
+            freshness_yesterday = freshness_today;
+            memset(&freshness_today, 0, sizeof(freshness_today));
+        }
+        freshness_today.yday = yday;
+    }
+    portEXIT_CRITICAL(&freshness_lock);
+    
+    if (new_day)
+        freshness_log_day(&freshness_yesterday);
+}
+
+// Parse a complete response body and return the unit rates through the supplied references
+void http_client_parse(char * response_buffer, uint8_t tariff_type, double * agile_rates_ref, uint64_t * agile_validity_ref, bool * got_unit_rate, double * unit_rate, bool * got_tracker_tomorrow_rate, double * tracker_tomorrow_rate)
 {
     double unit_rate_local = 0.0;
     bool got_unit_rate_local = 0;
     double tracker_tomorrow_rate_local = 0.0;
     bool got_tracker_tomorrow_rate_local = 0;
-	// Get content length from event handler
-	size_t content_length;
-	while (1) {
-		content_length = http_client_content_length(url);
-		ESP_LOGI(TAG, "content_length=%d", content_length);
-		if (content_length > 0) break;
-		vTaskDelay(100);
-	}
-
-	// Allocate buffer to store response of http request from event handler
-	char *response_buffer;
-	response_buffer = (char *) malloc(content_length+1);
-	if (response_buffer == NULL) {
-		ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-		while(1) {
-			vTaskDelay(1);
-		}
-	}
-	bzero(response_buffer, content_length+1);
-    ESP_LOGD(TAG, "Memory allocated");
-
-	// Get content from event handler
-	while(1) {
-		esp_err_t err = http_client_content_get(url, response_buffer);
-		if (err == ESP_OK) break;
-		vTaskDelay(100);
-	}
-	ESP_LOGD(TAG, "content_length=%d", content_length);
-	ESP_LOGD(TAG, "\n[%s]", response_buffer);
 
     if (!timeSet)
     {
@@ -725,53 +1019,1469 @@ void http_client(char * url, uint8_t tariff_type, double * agile_rates_ref, uint
                 *got_tracker_tomorrow_rate = got_tracker_tomorrow_rate_local;
         }
         
-        if (tariff_type == TARIFF_TYPE_AGILE)
+        if (tariff_type == TARIFF_TYPE_AGILE || tariff_type == TARIFF_TYPE_CARBON_INTENSITY)
         {
+            const char * series_name = (tariff_type == TARIFF_TYPE_AGILE) ? "Agile price" : "Carbon intensity";
             for (uint8_t i = 0; i < 48; i++)
             {
-                ESP_LOGI(TAG, "Agile price entry %d: %f", i, agile_rates_ref[i]);
+                ESP_LOGI(TAG, "%s entry %d: %f", series_name, i, agile_rates_ref[i]);
             }
-            ESP_LOGI(TAG, "Agile validity: %llX", *agile_validity_ref);
+            ESP_LOGI(TAG, "%s validity: %llX", series_name, *agile_validity_ref);
         }
         
         cJSON_Delete(root);
-        free(response_buffer);
     }
     if (unit_rate)
         *unit_rate = unit_rate_local;
     if (got_unit_rate)
         *got_unit_rate = got_unit_rate_local;
+    rate_store_version++;
+    
+    if (got_unit_rate_local)
+    {
+        freshness_data_t data = {
+            .got_today = true,
+            .today = unit_rate_local,
+            .got_tomorrow = got_tracker_tomorrow_rate_local,
+            .tomorrow = tracker_tomorrow_rate_local,
+        };
+        if (agile_rates_ref && agile_validity_ref)
+        {
+            data.is_series = true;
+            data.validity = *agile_validity_ref;
+            data.values_hash = freshness_series_hash(agile_rates_ref, *agile_validity_ref);
+        }
+        freshness_record_parse(got_unit_rate, &data);
+    }
 }
 
-// Task for testing the display task - disable get_unit_rates_task and enable this one to test extreme values
-void test_task(void * pvParameters)
+// Fetch the full response for url into a newly allocated buffer. Retries until it succeeds.
+char * http_client_fetch(char * url, size_t * response_length)
 {
-    ESP_LOGI(TAG, "Test task started");
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    ESP_LOGI(TAG, "Test task: Wifi connected");
-    wifi_connected = true;
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    ESP_LOGI(TAG, "Test task: Time set");
-    timeSet = true;
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    
-    gas_unit_rate = 2.73;
-    got_gas_unit_rate = true;
-    ESP_LOGI(TAG, "Test task: Gas unit rate set %f", gas_unit_rate);
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+	// Get content length from event handler
+	size_t content_length;
+	while (1) {
+		content_length = http_client_content_length(url);
+		ESP_LOGI(TAG, "content_length=%d", content_length);
+		if (content_length > 0) break;
+		vTaskDelay(100);
+	}
+
+	// Allocate buffer to store response of http request from event handler
+	char *response_buffer;
+	response_buffer = (char *) malloc(content_length+1);
+	if (response_buffer == NULL) {
+		ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
+		while(1) {
+			vTaskDelay(1);
+		}
+	}
+	bzero(response_buffer, content_length+1);
+    ESP_LOGD(TAG, "Memory allocated");
+
+	// Get content from event handler
+	while(1) {
+		esp_err_t err = http_client_content_get(url, response_buffer);
+		if (err == ESP_OK) break;
+		vTaskDelay(100);
+	}
+	ESP_LOGD(TAG, "content_length=%d", content_length);
+	ESP_LOGD(TAG, "\n[%s]", response_buffer);
+
+    if (response_length)
+        *response_length = content_length;
+    return response_buffer;
+}
+
+void http_client(char * url, uint8_t tariff_type, double * agile_rates_ref, uint64_t * agile_validity_ref, bool * got_unit_rate, double * unit_rate, bool * got_tracker_tomorrow_rate, double * tracker_tomorrow_rate)
+{
+    char *response_buffer = http_client_fetch(url, NULL);
+    http_client_parse(response_buffer, tariff_type, agile_rates_ref, agile_validity_ref, got_unit_rate, unit_rate, got_tracker_tomorrow_rate, tracker_tomorrow_rate);
+    free(response_buffer);
+}
+
+/* Publication probe
+ *
+ * While waiting for tomorrow's Tracker price or the rest of the Agile day, the full rate
+ * list would otherwise be downloaded and parsed every hour. Instead a one-entry query
+ * (period_from at the slot being waited for, page_size=1) is made first, and the full
+ * download only happens once that slot has been published.
+ */
+typedef struct {
+    const char * name;
+    uint32_t probes;                // Probes made
+    uint32_t probes_with_data;      // Probes that found new data and led to a full download
+    uint32_t probe_bytes;           // Total bytes received by probes
+    uint64_t bytes_avoided;         // Full download bytes saved by probes that found nothing
+    size_t last_full_bytes;         // Size of the last full download
+    int64_t last_full_parse_us;     // Parse time of the last full download
+} fetch_probe_stats_t;
+
+// Returns true if the probe response lists at least one rate
+bool probe_has_results(const char * response_buffer)
+{
+    cJSON *root = cJSON_Parse(response_buffer);
+    cJSON *results = cJSON_GetObjectItem(root, "results");
+    bool has_results = cJSON_GetArraySize(results) > 0;
+    cJSON_Delete(root);
+    return has_results;
+}
+
+// Build the probe url for a rates url: only the newest rate valid at or after 'from'
+void probe_url_for(char * probe_url, size_t probe_url_size, const char * url, time_t from)
+{
+    char from_string[21];
+    struct tm from_struct;
+    gmtime_r(&from, &from_struct);
+    strftime(from_string, sizeof(from_string), "%Y-%m-%dT%H:%M:%SZ", &from_struct);
+    snprintf(probe_url, probe_url_size, "%s?period_from=%s&page_size=1", url, from_string);
+}
+
+// Record the outcome of a probe. Returns true if the full download should go ahead.
+bool probe_record(fetch_probe_stats_t * stats, const char * response_buffer, size_t response_length)
+{
+    int64_t parse_start_us = esp_timer_get_time();
+    bool has_results = probe_has_results(response_buffer);
+    int64_t parse_us = esp_timer_get_time() - parse_start_us;
+
+    stats->probes++;
+    stats->probe_bytes += response_length;
+    if (has_results)
+    {
+        stats->probes_with_data++;
+    }
+    else
+    {
+        stats->bytes_avoided += stats->last_full_bytes;
+    }
+    ESP_LOGI(TAG, "Probe %s: %s, %d bytes, parse %lld us (last full download %d bytes, parse %lld us)",
+        stats->name, has_results ? "new data published" : "nothing new", response_length, parse_us,
+        stats->last_full_bytes, stats->last_full_parse_us);
+    ESP_LOGI(TAG, "Probe %s totals: %lu probes, %lu found data, %lu probe bytes, %llu full download bytes avoided",
+        stats->name, stats->probes, stats->probes_with_data, stats->probe_bytes, stats->bytes_avoided);
+    return has_results;
+}
+
+/* Streaming JSON key-path matcher
+ *
+ * Picks a few numbers out of a large JSON document as it arrives, without buffering the
+ * body or building a cJSON tree. Targets are given as keys from the root separated by '/'
+ * (array elements appear as '#'). Only enough of the syntax is checked to keep track of
+ * where in the document each value is; the document counts as complete once the root
+ * object closes.
+ */
+#define JSON_MATCHER_MAX_TARGETS 4
+#define JSON_MATCHER_MAX_DEPTH 12
+#define JSON_MATCHER_PATH_SIZE 128
+#define JSON_MATCHER_TOKEN_SIZE 48
+
+typedef enum {
+    JSON_LEX_VALUE,                 // Between tokens
+    JSON_LEX_STRING,
+    JSON_LEX_STRING_ESCAPE,
+    JSON_LEX_NUMBER,
+    JSON_LEX_LITERAL,               // true, false or null
+} json_lex_state_t;
+
+typedef struct json_matcher json_matcher_t;
+
+typedef struct {
+    const char * path;
+    double value;
+    bool found;
+} json_match_target_t;
+
+struct json_matcher {
+    json_match_target_t targets[JSON_MATCHER_MAX_TARGETS];
+    uint8_t target_count;
+    bool (*on_complete)(const json_matcher_t * matcher);    // Called with the results of a complete document; false if they aren't usable
     
-    elec_unit_rate = 16.5;
-    got_elec_unit_rate = true;
-    ESP_LOGI(TAG, "Test task: Elec unit rate set %f", elec_unit_rate);
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    // Parser state
+    json_lex_state_t lex;
+    uint8_t depth;                  // 0 outside the root
+    bool in_array[JSON_MATCHER_MAX_DEPTH + 1];
+    uint8_t container_path_len[JSON_MATCHER_MAX_DEPTH + 1];
+    char path[JSON_MATCHER_PATH_SIZE];
+    uint8_t path_len;
+    bool path_truncated;            // A key didn't fit, so nothing below it can match
+    bool expect_key;
+    bool string_is_key;
+    char token[JSON_MATCHER_TOKEN_SIZE];
+    uint8_t token_len;
+    bool complete;
+    bool error;
     
-    ESP_LOGI(TAG, "Test task: Unit rates unset");
-    got_gas_unit_rate = true;
-    got_elec_unit_rate = true;
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    // Statistics
+    uint32_t bytes;
+    int64_t parse_us;
+};
+
+// Clear the parser state and results, keeping the targets
+void json_matcher_reset(json_matcher_t * m)
+{
+    json_match_target_t targets[JSON_MATCHER_MAX_TARGETS];
+    uint8_t target_count = m->target_count;
+    bool (*on_complete)(const json_matcher_t * matcher) = m->on_complete;
     
-    gas_unit_rate = 0.0;
-    got_gas_unit_rate = true;
+    memcpy(targets, m->targets, sizeof(targets));
+    memset(m, 0, sizeof(json_matcher_t));
+    memcpy(m->targets, targets, sizeof(targets));
+    m->target_count = target_count;
+    m->on_complete = on_complete;
+    for (uint8_t i = 0; i < target_count; i++)
+        m->targets[i].found = false;
+}
+
+bool json_matcher_add_target(json_matcher_t * m, const char * path)
+{
+    if (m->target_count >= JSON_MATCHER_MAX_TARGETS)
+        return false;
+    m->targets[m->target_count].path = path;
+    m->targets[m->target_count].found = false;
+    m->target_count++;
+    return true;
+}
+
+// Set the path for the next value: the enclosing container's path plus a key or '#'
+void json_matcher_set_path(json_matcher_t * m, const char * segment, uint8_t segment_len)
+{
+    uint8_t base = m->container_path_len[m->depth];
+    bool separator = (base > 0);
+    
+    m->path_len = base;
+    m->path_truncated = false;
+    if (base + separator + segment_len >= JSON_MATCHER_PATH_SIZE)
+    {
+        m->path_truncated = true;
+    }
+    else
+    {
+        if (separator)
+            m->path[m->path_len++] = '/';
+        memcpy(m->path + m->path_len, segment, segment_len);
+        m->path_len += segment_len;
+    }
+    m->path[m->path_len] = '\0';
+}
+
+void json_matcher_number(json_matcher_t * m)
+{
+    m->token[m->token_len] = '\0';
+    if (m->path_truncated)
+        return;
+    for (uint8_t i = 0; i < m->target_count; i++)
+    {
+        if (!m->targets[i].found && strcmp(m->path, m->targets[i].path) == 0)
+        {
+            m->targets[i].value = strtod(m->token, NULL);
+            m->targets[i].found = true;
+        }
+    }
+}
+
+// Feed the next part of the document. Returns false once the document is found to be invalid.
+bool json_matcher_feed(json_matcher_t * m, const char * data, size_t len)
+{
+    int64_t start_us = esp_timer_get_time();
+    
+    for (size_t i = 0; i < len && !m->error; i++)
+    {
+        char c = data[i];
+        
+        switch (m->lex)
+        {
+            case JSON_LEX_STRING_ESCAPE:
+                m->lex = JSON_LEX_STRING;
+                // Escaped characters are kept as-is; keys of interest never contain them
+                if (m->string_is_key && m->token_len < JSON_MATCHER_TOKEN_SIZE - 1)
+                    m->token[m->token_len++] = c;
+                continue;
+                
+            case JSON_LEX_STRING:
+                if (c == '\\')
+                {
+                    m->lex = JSON_LEX_STRING_ESCAPE;
+                }
+                else if (c == '"')
+                {
+                    m->lex = JSON_LEX_VALUE;
+                    if (m->string_is_key)
+                    {
+                        json_matcher_set_path(m, m->token, m->token_len);
+                        // Keys longer than the token buffer can't be one of ours
+                        if (m->token_len >= JSON_MATCHER_TOKEN_SIZE - 1)
+                            m->path_truncated = true;
+                    }
+                }
+                else if (m->string_is_key && m->token_len < JSON_MATCHER_TOKEN_SIZE - 1)
+                {
+                    m->token[m->token_len++] = c;
+                }
+                continue;
+                
+            case JSON_LEX_NUMBER:
+                if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+                {
+                    if (m->token_len < JSON_MATCHER_TOKEN_SIZE - 1)
+                        m->token[m->token_len++] = c;
+                    continue;
+                }
+                json_matcher_number(m);
+                m->lex = JSON_LEX_VALUE;
+                break;      // Handle the character that ended the number below
+                
+            case JSON_LEX_LITERAL:
+                if (c >= 'a' && c <= 'z')
+                    continue;
+                m->lex = JSON_LEX_VALUE;
+                break;
+                
+            case JSON_LEX_VALUE:
+                break;
+        }
+        
+        if (m->complete)
+        {
+            if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+                m->error = true;
+            continue;
+        }
+        
+        switch (c)
+        {
+            case ' ': case '\t': case '\r': case '\n': case ':':
+                break;
+            case '{':
+            case '[':
+                if (m->depth >= JSON_MATCHER_MAX_DEPTH || (m->depth == 0 && c != '{'))
+                {
+                    m->error = true;
+                    break;
+                }
+                m->depth++;
+                m->in_array[m->depth] = (c == '[');
+                m->container_path_len[m->depth] = m->path_truncated ? JSON_MATCHER_PATH_SIZE - 1 : m->path_len;
+                m->expect_key = (c == '{');
+                if (c == '[')
+                    json_matcher_set_path(m, "#", 1);
+                break;
+            case '}':
+            case ']':
+                if (m->depth == 0 || m->in_array[m->depth] != (c == ']'))
+                {
+                    m->error = true;
+                    break;
+                }
+                m->depth--;
+                m->complete = (m->depth == 0);
+                break;
+            case ',':
+                if (m->depth == 0)
+                    m->error = true;
+                else if (m->in_array[m->depth])
+                    json_matcher_set_path(m, "#", 1);
+                else
+                    m->expect_key = true;
+                break;
+            case '"':
+                m->lex = JSON_LEX_STRING;
+                m->string_is_key = m->expect_key;
+                m->expect_key = false;
+                m->token_len = 0;
+                break;
+            case 't': case 'f': case 'n':
+                m->lex = JSON_LEX_LITERAL;
+                break;
+            default:
+                if ((c >= '0' && c <= '9') || c == '-')
+                {
+                    m->lex = JSON_LEX_NUMBER;
+                    m->token[0] = c;
+                    m->token_len = 1;
+                }
+                else
+                {
+                    m->error = true;
+                }
+                break;
+        }
+    }
+    m->bytes += len;
+    m->parse_us += esp_timer_get_time() - start_us;
+    return !m->error;
+}
+
+// True once a whole document has been fed without errors
+bool json_matcher_done(const json_matcher_t * m)
+{
+    return m->complete && !m->error && m->lex == JSON_LEX_VALUE;
+}
+
+/* Cost of fetching a group of rates, so that different ways of getting the same rates
+ * can be compared from the logs.
+ */
+typedef struct {
+    const char * name;
+    uint32_t requests;
+    uint32_t bytes;
+    int64_t parse_us;
+} fetch_cost_t;
+
+void fetch_cost_record(fetch_cost_t * cost, size_t bytes, int64_t parse_us)
+{
+    if (!cost)
+        return;
+    cost->requests++;
+    cost->bytes += bytes;
+    cost->parse_us += parse_us;
+}
+
+void fetch_cost_log(fetch_cost_t * cost)
+{
+    if (cost->requests)
+        ESP_LOGI(TAG, "%s fetch: %lu requests, %lu bytes, %lld us parsing", cost->name, cost->requests, cost->bytes, cost->parse_us);
+    cost->requests = 0;
+    cost->bytes = 0;
+    cost->parse_us = 0;
+}
+
+// Log two ways of getting the same rates side by side, after fetching both in one batch
+void fetch_cost_log_comparison(fetch_cost_t * a, fetch_cost_t * b)
+{
+    ESP_LOGI(TAG, "Fetch comparison: %s %lu requests, %lu bytes, %lld us parsing; %s %lu requests, %lu bytes, %lld us parsing",
+        a->name, a->requests, a->bytes, a->parse_us, b->name, b->requests, b->bytes, b->parse_us);
+    a->requests = b->requests = 0;
+    a->bytes = b->bytes = 0;
+    a->parse_us = b->parse_us = 0;
+}
+
+/* Flexible rates from the product detail endpoint. One response carries every region's
+ * electricity and gas rates for each payment method, so both fuels come from one request.
+ */
+#define FLEX_TARGET_ELEC 0
+#define FLEX_TARGET_GAS 1
+
+// Set up matcher to find the direct debit unit rates for the region of the configured tariff codes
+void flexible_product_matcher_init(json_matcher_t * matcher, char * elec_path, char * gas_path, size_t path_size, bool (*on_complete)(const json_matcher_t * matcher))
+{
+    // Tariff codes end in the region letter, e.g. E-1R-VAR-22-11-01-C
+    const char * elec_code = CONFIG_ESP_TARIFF_ELEC_FLEX;
+    const char * gas_code = CONFIG_ESP_TARIFF_GAS_FLEX;
+    char elec_region = elec_code[0] ? elec_code[strlen(elec_code) - 1] : 'A';
+    char gas_region = gas_code[0] ? gas_code[strlen(gas_code) - 1] : 'A';
+    
+    if (elec_region < 'A' || elec_region > 'P')
+        ESP_LOGE(TAG, "Flexible elec tariff code %s doesn't end in a region letter", elec_code);
+    if (gas_region < 'A' || gas_region > 'P')
+        ESP_LOGE(TAG, "Flexible gas tariff code %s doesn't end in a region letter", gas_code);
+    snprintf(elec_path, path_size, "single_register_electricity_tariffs/_%c/direct_debit_monthly/standard_unit_rate_inc_vat", elec_region);
+    snprintf(gas_path, path_size, "single_register_gas_tariffs/_%c/direct_debit_monthly/standard_unit_rate_inc_vat", gas_region);
+    memset(matcher, 0, sizeof(json_matcher_t));
+    json_matcher_add_target(matcher, elec_path);
+    json_matcher_add_target(matcher, gas_path);
+    matcher->on_complete = on_complete;
+}
+
+// Store the rates found in a complete product detail response. Returns false if either
+// fuel's rate for the region wasn't in it, so the request is retried.
+bool flexible_product_apply(const json_matcher_t * matcher)
+{
+    const json_match_target_t * elec = &matcher->targets[FLEX_TARGET_ELEC];
+    const json_match_target_t * gas = &matcher->targets[FLEX_TARGET_GAS];
+    ESP_LOGI(TAG, "Flexible product: elec %s %f, gas %s %f", elec->found ? "found" : "not found", elec->value, gas->found ? "found" : "not found", gas->value);
+    if (!elec->found)
+        ESP_LOGE(TAG, "No Flexible elec rate in the product detail, check the region letter of the tariff code: %s", elec->path);
+    if (!gas->found)
+        ESP_LOGE(TAG, "No Flexible gas rate in the product detail, check the region letter of the tariff code: %s", gas->path);
+    if (elec->found)
+    {
+        elec_flex_unit_rate = elec->value;
+        got_elec_flex_unit_rate = true;
+        freshness_data_t data = { .got_today = true, .today = elec->value };
+        freshness_record_parse(&got_elec_flex_unit_rate, &data);
+    }
+    if (gas->found)
+    {
+        gas_flex_unit_rate = gas->value;
+        got_gas_flex_unit_rate = true;
+        freshness_data_t data = { .got_today = true, .today = gas->value };
+        freshness_record_parse(&got_gas_flex_unit_rate, &data);
+    }
+    rate_store_version++;
+    return elec->found && gas->found;
+}
+
+/* Asynchronous fetch engine
+ *
+ * Runs several tariff requests concurrently from the calling task. Each request is a
+ * resumable state machine driven over a non-blocking esp-tls connection, so connects,
+ * TLS handshakes and body reads of different requests are interleaved without needing
+ * a task (and a stack) per request. select() is used to sleep until one of the sockets
+ * has something to do.
+ *
+ * HTTP/1.1 is spoken directly with "Connection: close"; bodies are accepted with a
+ * Content-Length, chunked transfer encoding or read until the server closes. Requests with
+ * a JSON matcher have their body fed to it as it arrives instead of being buffered.
+ *
+ * Each request can have two connections ("legs") in flight. The latency of completed
+ * fetches is tracked, and when a request has taken longer than the recent 95th percentile
+ * a hedged leg is sent to the secondary source (or the primary again). Whichever leg
+ * completes first with a valid response wins and the other is cancelled.
+ */
+static const char *TAG_FE = "FETCH";
+
+typedef enum {
+    FETCH_STATE_WAITING,            // Not started yet, waiting for a free connection
+    FETCH_STATE_ACTIVE,             // One or both legs in progress
+    FETCH_STATE_BACKOFF,            // All legs failed, waiting before retrying
+    FETCH_STATE_DONE,               // Response received and parsed
+} fetch_state_t;
+
+typedef enum {
+    FETCH_LEG_IDLE,                 // Not in use
+    FETCH_LEG_CONNECTING,           // TCP connect and TLS handshake in progress
+    FETCH_LEG_SENDING,              // Sending the request
+    FETCH_LEG_HEADERS,              // Reading the status line and headers
+    FETCH_LEG_BODY,                 // Reading the response body
+    FETCH_LEG_COMPLETE,             // Complete response received
+    FETCH_LEG_FAILED,               // Gave up on this connection
+} fetch_leg_state_t;
+
+typedef enum {
+    FETCH_BODY_UNTIL_CLOSE,
+    FETCH_BODY_CONTENT_LENGTH,
+    FETCH_BODY_CHUNK_SIZE,
+    FETCH_BODY_CHUNK_DATA,
+    FETCH_BODY_CHUNK_END,
+    FETCH_BODY_TRAILER,
+} fetch_body_mode_t;
+
+#define FETCH_LEG_PRIMARY 0
+#define FETCH_LEG_HEDGE 1
+#define FETCH_LEGS 2
+
+// One connection for a request
+typedef struct {
+    fetch_leg_state_t state;
+    esp_tls_t * tls;
+    esp_tls_cfg_t tls_cfg;
+    char host[64];
+    uint16_t port;
+    char request[384];
+    size_t request_len;
+    size_t request_sent;
+
+    // Response state
+    char line[256];
+    size_t line_len;
+    int status_code;
+    bool chunked;
+    fetch_body_mode_t body_mode;
+    size_t body_remaining;
+    char * response_buffer;
+    size_t response_len;
+    size_t response_size;
+    json_matcher_t * matcher;       // Body goes here instead of the buffer if set
+
+    int64_t start_us;
+} fetch_leg_t;
+
+typedef struct {
+    // Request and where to put the parsed result (same references as http_client)
+    char url[255];
+    uint8_t tariff_type;
+    double * agile_rates_ref;
+    uint64_t * agile_validity_ref;
+    bool * got_unit_rate;
+    double * unit_rate;
+    bool * got_tracker_tomorrow_rate;
+    double * tracker_tomorrow_rate;
+    // Optional matcher that takes the place of http_client_parse, with one working copy per leg
+    json_matcher_t * matcher;
+    json_matcher_t leg_matchers[2];
+    fetch_cost_t * cost;
+
+    // Optional publication probe made before the full download
+    char probe_url[255];
+    bool probing;
+    fetch_probe_stats_t * probe_stats;
+
+    fetch_state_t state;
+    fetch_leg_t legs[FETCH_LEGS];
+    bool hedged;
+
+    // Statistics
+    int64_t start_us;
+    int64_t deadline_us;
+    int64_t retry_at_us;
+    uint16_t attempts;
+    uint8_t rejected;           // Complete responses the matcher found unusable
+} fetch_request_t;
+
+#define FETCH_ENGINE_MAX_REQUESTS 8
+#define FETCH_ENGINE_READ_CHUNK 512
+#define FETCH_ENGINE_SELECT_TIMEOUT_MS 20
+#define FETCH_ENGINE_REQUEST_TIMEOUT_US (30 * 1000000LL)
+#define FETCH_ENGINE_RETRY_DELAY_US (1000000LL)
+#define FETCH_ENGINE_INITIAL_BUFFER 4096
+// A response that arrives intact but lacks the rates (e.g. a wrong region letter) is
+// retried a few times, then left until the next check
+#define FETCH_MAX_REJECTED 3
+// With hedging on, one connection is kept free for hedged legs so that hedging never takes
+// the number of open connections (and TLS sessions) over CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT
+#define FETCH_ENGINE_MAX_PRIMARY ((CONFIG_ESP_FETCH_HEDGE_ENABLE && CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT > 1) \
+    ? CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT - 1 : CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT)
+
+/* Rolling latency of fetches, used to decide when to hedge. Requests that time out are
+ * recorded as taking the full timeout so that a slow source raises the percentiles.
+ * Probes and full downloads are tracked separately as their sizes differ so much.
+ */
+#define FETCH_LATENCY_WINDOW 32
+#define FETCH_HEDGE_MIN_SAMPLES 8
+
+typedef struct {
+    const char * name;
+    uint32_t samples_ms[FETCH_LATENCY_WINDOW];
+    uint8_t next;
+    uint8_t count;
+    uint32_t p50_ms;
+    uint32_t p95_ms;                // 0 until there are enough samples to hedge on
+    uint32_t hedges_fired;
+    uint32_t hedges_won;
+} fetch_latency_t;
+
+static fetch_latency_t fetch_latency_full = { .name = "full" };
+static fetch_latency_t fetch_latency_probe = { .name = "probe" };
+
+void fetch_latency_record(fetch_latency_t * latency, uint32_t elapsed_ms)
+{
+    uint32_t sorted[FETCH_LATENCY_WINDOW];
+
+    latency->samples_ms[latency->next] = elapsed_ms;
+    latency->next = (latency->next + 1) % FETCH_LATENCY_WINDOW;
+    if (latency->count < FETCH_LATENCY_WINDOW)
+        latency->count++;
+
+    // Insertion sort a copy of the window to find the percentiles
+    for (uint8_t i = 0; i < latency->count; i++)
+    {
+        uint32_t value = latency->samples_ms[i];
+        int8_t j = i - 1;
+        while (j >= 0 && sorted[j] > value)
+        {
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = value;
+    }
+    latency->p50_ms = sorted[(latency->count - 1) * 50 / 100];
+    latency->p95_ms = (latency->count >= FETCH_HEDGE_MIN_SAMPLES) ? sorted[(latency->count - 1) * 95 / 100] : 0;
+}
+
+// Add a request to a batch. Returns false if the batch is full.
+bool fetch_request_add(fetch_request_t * requests, uint8_t * request_count, const char * url, uint8_t tariff_type, double * agile_rates_ref, uint64_t * agile_validity_ref, bool * got_unit_rate, double * unit_rate, bool * got_tracker_tomorrow_rate, double * tracker_tomorrow_rate)
+{
+    if (*request_count >= FETCH_ENGINE_MAX_REQUESTS)
+    {
+        ESP_LOGE(TAG_FE, "Too many requests in batch, dropping %s", url);
+        return false;
+    }
+    fetch_request_t * r = &requests[*request_count];
+    memset(r, 0, sizeof(fetch_request_t));
+    strlcpy(r->url, url, sizeof(r->url));
+    r->tariff_type = tariff_type;
+    r->agile_rates_ref = agile_rates_ref;
+    r->agile_validity_ref = agile_validity_ref;
+    r->got_unit_rate = got_unit_rate;
+    r->unit_rate = unit_rate;
+    r->got_tracker_tomorrow_rate = got_tracker_tomorrow_rate;
+    r->tracker_tomorrow_rate = tracker_tomorrow_rate;
+    r->state = FETCH_STATE_WAITING;
+    (*request_count)++;
+    return true;
+}
+
+// Attach probe statistics to a request, and a probe url to check before the full download (NULL for none)
+void fetch_request_set_probe(fetch_request_t * r, fetch_probe_stats_t * stats, const char * probe_url)
+{
+    r->probe_stats = stats;
+    if (probe_url)
+    {
+        strlcpy(r->probe_url, probe_url, sizeof(r->probe_url));
+        r->probing = true;
+    }
+}
+
+// Extract values from the body with matcher as it arrives, instead of buffering and parsing it
+void fetch_request_set_matcher(fetch_request_t * r, json_matcher_t * matcher)
+{
+    r->matcher = matcher;
+}
+
+// Count the requests, bytes and parse time of this request towards cost
+void fetch_request_set_cost(fetch_request_t * r, fetch_cost_t * cost)
+{
+    r->cost = cost;
+}
+
+// Split a URL into scheme, host, port and path. Path points into the url string.
+bool fetch_parse_url(const char * url, bool * https, char * host, size_t host_size, uint16_t * port, const char ** path)
+{
+    const char * p;
+    if (strncmp(url, "https://", 8) == 0)
+    {
+        *https = true;
+        *port = 443;
+        p = url + 8;
+    }
+    else if (strncmp(url, "http://", 7) == 0)
+    {
+        *https = false;
+        *port = 80;
+        p = url + 7;
+    }
+    else
+    {
+        return false;
+    }
+    size_t host_len = strcspn(p, ":/");
+    if (host_len == 0 || host_len >= host_size)
+    {
+        return false;
+    }
+    memcpy(host, p, host_len);
+    host[host_len] = '\0';
+    p += host_len;
+    if (*p == ':')
+    {
+        *port = (uint16_t)strtoul(p + 1, (char **)&p, 10);
+    }
+    *path = (*p == '/') ? p : "/";
+    return true;
+}
+
+// Url for a hedged leg: the same path on the secondary source, or the primary again if none is set.
+// The secondary source only mirrors the Octopus API, so other sources are hedged to themselves.
+void fetch_hedge_url(char * hedge_url, size_t hedge_url_size, const char * url)
+{
+    size_t base_len = strlen(CONFIG_ESP_OCTOPUS_API_URL);
+
+    if (CONFIG_ESP_FETCH_HEDGE_BASE_URL[0] == '\0' || strncmp(url, CONFIG_ESP_OCTOPUS_API_URL, base_len) != 0
+        || url[base_len] != '/')
+    {
+        strlcpy(hedge_url, url, hedge_url_size);
+        return;
+    }
+    snprintf(hedge_url, hedge_url_size, "%s%s", CONFIG_ESP_FETCH_HEDGE_BASE_URL, url + base_len);
+}
+
+// Release the connection and any partial response
+void fetch_leg_close(fetch_leg_t * leg)
+{
+    if (leg->tls)
+    {
+        esp_tls_conn_destroy(leg->tls);
+        leg->tls = NULL;
+    }
+    free(leg->response_buffer);
+    leg->response_buffer = NULL;
+    leg->response_len = 0;
+    leg->response_size = 0;
+}
+
+void fetch_leg_fail(fetch_request_t * r, fetch_leg_t * leg, const char * reason)
+{
+    ESP_LOGW(TAG_FE, "%s leg failed (%s), attempt %d: %s", (leg == &r->legs[FETCH_LEG_HEDGE]) ? "Hedged" : "Primary",
+        reason, r->attempts, r->probing ? r->probe_url : r->url);
+    fetch_leg_close(leg);
+    leg->state = FETCH_LEG_FAILED;
+}
+
+// Open a non-blocking connection for url and prepare the request text
+bool fetch_leg_start(fetch_request_t * r, fetch_leg_t * leg, const char * url)
+{
+    bool https;
+    const char * path;
+
+    leg->start_us = esp_timer_get_time();
+    leg->line_len = 0;
+    leg->status_code = 0;
+    leg->chunked = false;
+    leg->body_mode = FETCH_BODY_UNTIL_CLOSE;
+    leg->body_remaining = 0;
+    leg->request_sent = 0;
+    leg->response_len = 0;
+    leg->matcher = NULL;
+    if (r->matcher && !r->probing)
+    {
+        leg->matcher = &r->leg_matchers[leg - r->legs];
+        *leg->matcher = *r->matcher;
+        json_matcher_reset(leg->matcher);
+    }
+
+    if (!fetch_parse_url(url, &https, leg->host, sizeof(leg->host), &leg->port, &path))
+    {
+        fetch_leg_fail(r, leg, "bad url");
+        return false;
+    }
+    leg->request_len = snprintf(leg->request, sizeof(leg->request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ESP32 HTTP Client/1.0\r\nAccept: application/json\r\nConnection: close\r\n\r\n",
+        path, leg->host);
+    if (leg->request_len >= sizeof(leg->request))
+    {
+        fetch_leg_fail(r, leg, "request too long");
+        return false;
+    }
+
+    leg->tls = esp_tls_init();
+    if (leg->tls == NULL)
+    {
+        fetch_leg_fail(r, leg, "no memory for tls");
+        return false;
+    }
+    // esp-tls keeps referring to the host and config on every call until connected,
+    // so both live in the leg rather than on the stack
+    const char * cert_pem = root_cert_for_url(url);
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = (const unsigned char *)cert_pem,
+        .cacert_bytes = strlen(cert_pem) + 1,
+        .non_block = true,
+        .timeout_ms = FETCH_ENGINE_REQUEST_TIMEOUT_US / 1000,
+        .is_plain_tcp = !https,
+    };
+    leg->tls_cfg = cfg;
+    if (esp_tls_conn_new_async(leg->host, strlen(leg->host), leg->port, &leg->tls_cfg, leg->tls) < 0)
+    {
+        fetch_leg_fail(r, leg, "connect");
+        return false;
+    }
+    leg->state = FETCH_LEG_CONNECTING;
+    return true;
+}
+
+// Append body bytes to the response buffer
+bool fetch_body_append(fetch_leg_t * leg, const char * data, size_t len)
+{
+    if (leg->matcher)
+    {
+        leg->response_len += len;
+        return json_matcher_feed(leg->matcher, data, len);
+    }
+    if (leg->response_len + len + 1 > leg->response_size)
+    {
+        size_t new_size = leg->response_size ? leg->response_size : FETCH_ENGINE_INITIAL_BUFFER;
+        while (new_size < leg->response_len + len + 1)
+        {
+            new_size *= 2;
+        }
+        char * new_buffer = realloc(leg->response_buffer, new_size);
+        if (new_buffer == NULL)
+        {
+            ESP_LOGE(TAG_FE, "Failed to allocate %d bytes for response", new_size);
+            return false;
+        }
+        leg->response_buffer = new_buffer;
+        leg->response_size = new_size;
+    }
+    memcpy(leg->response_buffer + leg->response_len, data, len);
+    leg->response_len += len;
+    leg->response_buffer[leg->response_len] = '\0';
+    return true;
+}
+
+// Handle one complete header line (without CRLF)
+void fetch_header_line(fetch_leg_t * leg, char * line)
+{
+    if (leg->status_code == 0)
+    {
+        // Status line: HTTP/1.1 200 OK
+        char * space = strchr(line, ' ');
+        leg->status_code = space ? atoi(space + 1) : -1;
+    }
+    else if (strncasecmp(line, "Date:", 5) == 0)
+    {
+        set_time_from_date_header(line + 5 + strspn(line + 5, " "));
+    }
+    else if (strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+        leg->body_mode = FETCH_BODY_CONTENT_LENGTH;
+        leg->body_remaining = strtoul(line + 15, NULL, 10);
+    }
+    else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked"))
+    {
+        leg->chunked = true;
+    }
+}
+
+// Feed received bytes through the header and body decoders.
+// Returns 1 when the response is complete, 0 if more is needed, -1 on error.
+int fetch_process_bytes(fetch_leg_t * leg, const char * data, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        if (leg->state == FETCH_LEG_HEADERS || leg->body_mode == FETCH_BODY_CHUNK_SIZE
+            || leg->body_mode == FETCH_BODY_CHUNK_END || leg->body_mode == FETCH_BODY_TRAILER)
+        {
+            // Line oriented parts of the response
+            char c = data[i++];
+            if (c != '\n')
+            {
+                if (c != '\r' && leg->line_len < sizeof(leg->line) - 1)
+                {
+                    leg->line[leg->line_len++] = c;
+                }
+                continue;
+            }
+            leg->line[leg->line_len] = '\0';
+            size_t line_len = leg->line_len;
+            leg->line_len = 0;
+
+            if (leg->state == FETCH_LEG_HEADERS)
+            {
+                if (line_len > 0)
+                {
+                    fetch_header_line(leg, leg->line);
+                    continue;
+                }
+                // Blank line: end of headers
+                if (leg->status_code != 200)
+                {
+                    ESP_LOGW(TAG_FE, "HTTP status %d from %s", leg->status_code, leg->host);
+                    return -1;
+                }
+                leg->state = FETCH_LEG_BODY;
+                if (leg->chunked)
+                {
+                    leg->body_mode = FETCH_BODY_CHUNK_SIZE;
+                }
+                else if (leg->body_mode == FETCH_BODY_CONTENT_LENGTH)
+                {
+                    if (leg->body_remaining == 0)
+                        return 1;
+                    // Allocate the whole body up front when the size is known, unless a
+                    // matcher is parsing it as it streams in and it isn't kept
+                    if (!leg->matcher && leg->response_size < leg->body_remaining + 1)
+                    {
+                        char * new_buffer = realloc(leg->response_buffer, leg->body_remaining + 1);
+                        if (new_buffer == NULL)
+                            return -1;
+                        leg->response_buffer = new_buffer;
+                        leg->response_size = leg->body_remaining + 1;
+                    }
+                }
+            }
+            else if (leg->body_mode == FETCH_BODY_CHUNK_SIZE)
+            {
+                leg->body_remaining = strtoul(leg->line, NULL, 16);
+                leg->body_mode = leg->body_remaining ? FETCH_BODY_CHUNK_DATA : FETCH_BODY_TRAILER;
+            }
+            else if (leg->body_mode == FETCH_BODY_CHUNK_END)
+            {
+                leg->body_mode = FETCH_BODY_CHUNK_SIZE;
+            }
+            else if (line_len == 0)
+            {
+                // Blank line after the last chunk's trailers
+                return 1;
+            }
+        }
+        else
+        {
+            // Body data
+            size_t n = len - i;
+            if (leg->body_mode != FETCH_BODY_UNTIL_CLOSE && n > leg->body_remaining)
+            {
+                n = leg->body_remaining;
+            }
+            if (!fetch_body_append(leg, data + i, n))
+            {
+                return -1;
+            }
+            i += n;
+            if (leg->body_mode == FETCH_BODY_UNTIL_CLOSE)
+            {
+                continue;
+            }
+            leg->body_remaining -= n;
+            if (leg->body_remaining == 0)
+            {
+                if (leg->body_mode == FETCH_BODY_CONTENT_LENGTH)
+                    return 1;
+                leg->body_mode = FETCH_BODY_CHUNK_END;
+            }
+        }
+    }
+    return 0;
+}
+
+// A leg has a complete response; it counts as valid if it has a body that looks like JSON
+void fetch_leg_received(fetch_request_t * r, fetch_leg_t * leg)
+{
+    if (leg->tls)
+    {
+        esp_tls_conn_destroy(leg->tls);
+        leg->tls = NULL;
+    }
+    if (leg->matcher ? !json_matcher_done(leg->matcher)
+        : (leg->response_len == 0 || leg->response_buffer[strspn(leg->response_buffer, " \r\n\t")] != '{'))
+    {
+        fetch_leg_fail(r, leg, "invalid body");
+        return;
+    }
+    leg->state = FETCH_LEG_COMPLETE;
+}
+
+// Advance one leg as far as it can go without blocking. Returns true if anything happened.
+bool fetch_leg_step(fetch_request_t * r, fetch_leg_t * leg)
+{
+    char chunk[FETCH_ENGINE_READ_CHUNK];
+    int ret;
+
+    switch (leg->state)
+    {
+        case FETCH_LEG_CONNECTING:
+            ret = esp_tls_conn_new_async(leg->host, strlen(leg->host), leg->port, &leg->tls_cfg, leg->tls);
+            if (ret < 0)
+            {
+                fetch_leg_fail(r, leg, "tls handshake");
+                return true;
+            }
+            if (ret == 0)
+            {
+                return false;
+            }
+            ESP_LOGD(TAG_FE, "Connected to %s after %lld ms", leg->host, (esp_timer_get_time() - leg->start_us) / 1000);
+            leg->state = FETCH_LEG_SENDING;
+            // fall through
+
+        case FETCH_LEG_SENDING:
+            ret = esp_tls_conn_write(leg->tls, leg->request + leg->request_sent, leg->request_len - leg->request_sent);
+            if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE)
+            {
+                return false;
+            }
+            if (ret < 0)
+            {
+                fetch_leg_fail(r, leg, "write");
+                return true;
+            }
+            leg->request_sent += ret;
+            if (leg->request_sent < leg->request_len)
+            {
+                return true;
+            }
+            leg->state = FETCH_LEG_HEADERS;
+            return true;
+
+        case FETCH_LEG_HEADERS:
+        case FETCH_LEG_BODY:
+            ret = esp_tls_conn_read(leg->tls, chunk, sizeof(chunk));
+            if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE
+                || (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+            {
+                return false;
+            }
+            if (ret < 0)
+            {
+                fetch_leg_fail(r, leg, "read");
+                return true;
+            }
+            if (ret == 0)
+            {
+                // Connection closed by the server
+                if (leg->state == FETCH_LEG_BODY && leg->body_mode == FETCH_BODY_UNTIL_CLOSE)
+                {
+                    fetch_leg_received(r, leg);
+                }
+                else
+                {
+                    fetch_leg_fail(r, leg, "closed early");
+                }
+                return true;
+            }
+            ret = fetch_process_bytes(leg, chunk, ret);
+            if (ret > 0)
+            {
+                fetch_leg_received(r, leg);
+            }
+            else if (ret < 0)
+            {
+                fetch_leg_fail(r, leg, "bad response");
+            }
+            return true;
+
+        default:
+            break;
+    }
+    return false;
+}
+
+bool fetch_leg_in_progress(const fetch_leg_t * leg)
+{
+    return leg->state >= FETCH_LEG_CONNECTING && leg->state <= FETCH_LEG_BODY;
+}
+
+// Close every leg of a request and wait before trying again
+void fetch_request_backoff(fetch_request_t * r)
+{
+    for (uint8_t i = 0; i < FETCH_LEGS; i++)
+    {
+        fetch_leg_close(&r->legs[i]);
+        r->legs[i].state = FETCH_LEG_IDLE;
+    }
+    r->retry_at_us = esp_timer_get_time() + FETCH_ENGINE_RETRY_DELAY_US;
+    r->state = FETCH_STATE_BACKOFF;
+}
+
+// Start a request on its primary leg
+bool fetch_request_start(fetch_request_t * r)
+{
+    r->attempts++;
+    r->hedged = false;
+    r->start_us = esp_timer_get_time();
+    r->deadline_us = r->start_us + FETCH_ENGINE_REQUEST_TIMEOUT_US;
+    r->state = FETCH_STATE_ACTIVE;
+    if (!fetch_leg_start(r, &r->legs[FETCH_LEG_PRIMARY], r->probing ? r->probe_url : r->url))
+    {
+        fetch_request_backoff(r);
+        return false;
+    }
+    return true;
+}
+
+// Use the winning leg's response: cancel the other leg, then parse into the tariff variables
+void fetch_request_complete(fetch_request_t * r, fetch_leg_t * winner)
+{
+    fetch_latency_t * latency = r->probing ? &fetch_latency_probe : &fetch_latency_full;
+    int64_t elapsed_us = esp_timer_get_time() - r->start_us;
+    bool hedge_won = (winner == &r->legs[FETCH_LEG_HEDGE]);
+
+    for (uint8_t i = 0; i < FETCH_LEGS; i++)
+    {
+        if (&r->legs[i] != winner && fetch_leg_in_progress(&r->legs[i]))
+        {
+            ESP_LOGI(TAG_FE, "Cancelling slower %s leg", (i == FETCH_LEG_HEDGE) ? "hedged" : "primary");
+            fetch_leg_close(&r->legs[i]);
+        }
+        if (&r->legs[i] != winner)
+            r->legs[i].state = FETCH_LEG_IDLE;
+    }
+    fetch_latency_record(latency, elapsed_us / 1000);
+    if (hedge_won)
+        latency->hedges_won++;
+
+    ESP_LOGI(TAG_FE, "Fetched %d bytes from %s in %lld ms (attempt %d%s): %s", winner->response_len, winner->host, elapsed_us / 1000,
+        r->attempts, hedge_won ? ", hedge won" : "", r->probing ? r->probe_url : r->url);
+
+    if (r->probing)
+    {
+        r->probing = false;
+        bool has_results = probe_record(r->probe_stats, winner->response_buffer, winner->response_len);
+        if (!has_results)
+            freshness_record_check(r->got_unit_rate);
+        fetch_leg_close(winner);
+        winner->state = FETCH_LEG_IDLE;
+        // Go round again for the full download, or leave the current rates alone
+        r->attempts = 0;
+        r->state = has_results ? FETCH_STATE_WAITING : FETCH_STATE_DONE;
+        return;
+    }
+    if (winner->matcher)
+    {
+        fetch_cost_record(r->cost, winner->response_len, winner->matcher->parse_us);
+        bool accepted = winner->matcher->on_complete(winner->matcher);
+        winner->matcher = NULL;
+        fetch_leg_close(winner);
+        winner->state = FETCH_LEG_IDLE;
+        if (!accepted && ++r->rejected < FETCH_MAX_REJECTED)
+        {
+            ESP_LOGW(TAG_FE, "Response rejected (%d of %d), retrying: %s", r->rejected, FETCH_MAX_REJECTED, r->url);
+            fetch_request_backoff(r);
+            return;
+        }
+        if (!accepted)
+            ESP_LOGE(TAG_FE, "Response rejected %d times, giving up until the next check: %s", r->rejected, r->url);
+        r->state = FETCH_STATE_DONE;
+        return;
+    }
+    int64_t parse_start_us = esp_timer_get_time();
+    http_client_parse(winner->response_buffer, r->tariff_type, r->agile_rates_ref, r->agile_validity_ref, r->got_unit_rate, r->unit_rate, r->got_tracker_tomorrow_rate, r->tracker_tomorrow_rate);
+    fetch_cost_record(r->cost, winner->response_len, esp_timer_get_time() - parse_start_us);
+    if (r->probe_stats)
+    {
+        r->probe_stats->last_full_bytes = winner->response_len;
+        r->probe_stats->last_full_parse_us = esp_timer_get_time() - parse_start_us;
+    }
+    fetch_leg_close(winner);
+    winner->state = FETCH_LEG_IDLE;
+    r->state = FETCH_STATE_DONE;
+}
+
+// Advance one request as far as it can go without blocking. Returns true if anything happened.
+// may_hedge is false when there is no connection free for a hedged leg.
+bool fetch_request_step(fetch_request_t * r, bool may_hedge)
+{
+    int64_t now = esp_timer_get_time();
+    bool progressed = false;
+
+    if (r->state == FETCH_STATE_BACKOFF && now >= r->retry_at_us)
+    {
+        r->state = FETCH_STATE_WAITING;
+        return true;
+    }
+    if (r->state != FETCH_STATE_ACTIVE)
+    {
+        return false;
+    }
+    if (now > r->deadline_us)
+    {
+        ESP_LOGW(TAG_FE, "Request timed out, attempt %d: %s", r->attempts, r->probing ? r->probe_url : r->url);
+        fetch_latency_record(r->probing ? &fetch_latency_probe : &fetch_latency_full, FETCH_ENGINE_REQUEST_TIMEOUT_US / 1000);
+        fetch_request_backoff(r);
+        return true;
+    }
+
+    for (uint8_t i = 0; i < FETCH_LEGS; i++)
+    {
+        fetch_leg_t * leg = &r->legs[i];
+        if (fetch_leg_step(r, leg))
+            progressed = true;
+        if (leg->state == FETCH_LEG_COMPLETE)
+        {
+            fetch_request_complete(r, leg);
+            return true;
+        }
+    }
+
+    if (!fetch_leg_in_progress(&r->legs[FETCH_LEG_PRIMARY]) && !fetch_leg_in_progress(&r->legs[FETCH_LEG_HEDGE]))
+    {
+        fetch_request_backoff(r);
+        return true;
+    }
+
+    // Hedge once the request is slower than nearly all recent ones
+    fetch_latency_t * latency = r->probing ? &fetch_latency_probe : &fetch_latency_full;
+    if (CONFIG_ESP_FETCH_HEDGE_ENABLE && may_hedge && !r->hedged && latency->p95_ms > 0 && (now - r->start_us) / 1000 > latency->p95_ms)
+    {
+        char hedge_url[255];
+        fetch_hedge_url(hedge_url, sizeof(hedge_url), r->probing ? r->probe_url : r->url);
+        ESP_LOGI(TAG_FE, "No response after %lld ms (p95 %lu ms), hedging to %s", (now - r->start_us) / 1000, latency->p95_ms, hedge_url);
+        r->hedged = true;
+        latency->hedges_fired++;
+        fetch_leg_start(r, &r->legs[FETCH_LEG_HEDGE], hedge_url);
+        progressed = true;
+    }
+    return progressed;
+}
+
+// Log memory and timing for a batch so the async and sequential paths can be compared
+void fetch_log_batch_stats(const char * path, uint8_t request_count, int64_t start_us, uint32_t heap_before, uint32_t heap_min)
+{
+    ESP_LOGI(TAG_FE, "%s batch: %d requests in %lld ms, heap before %lu, lowest during batch %lu, lowest ever %lu, task stack free %u",
+        path, request_count, (esp_timer_get_time() - start_us) / 1000,
+        heap_before, heap_min, esp_get_minimum_free_heap_size(), uxTaskGetStackHighWaterMark(NULL));
+    const fetch_latency_t * latencies[] = { &fetch_latency_full, &fetch_latency_probe };
+    for (uint8_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+    {
+        ESP_LOGI(TAG_FE, "Latency %s: %d samples, p50 %lu ms, p95 %lu ms, hedges fired %lu, hedges won %lu",
+            latencies[i]->name, latencies[i]->count, latencies[i]->p50_ms, latencies[i]->p95_ms,
+            latencies[i]->hedges_fired, latencies[i]->hedges_won);
+    }
+}
+
+// Number of connections open across the batch, hedged legs included
+uint8_t fetch_active_legs(const fetch_request_t * requests, uint8_t request_count)
+{
+    uint8_t active = 0;
+    for (uint8_t i = 0; i < request_count; i++)
+    {
+        for (uint8_t j = 0; j < FETCH_LEGS; j++)
+        {
+            if (fetch_leg_in_progress(&requests[i].legs[j]))
+                active++;
+        }
+    }
+    return active;
+}
+
+// Run all requests in the batch to completion from the calling task
+void fetch_engine_run(fetch_request_t * requests, uint8_t request_count)
+{
+    int64_t batch_start_us = esp_timer_get_time();
+    uint32_t heap_before = esp_get_free_heap_size();
+    uint32_t heap_min = heap_before;
+    uint8_t remaining;
+
+    do
+    {
+        bool progressed = false;
+        remaining = 0;
+
+        for (uint8_t i = 0; i < request_count; i++)
+        {
+            fetch_request_t * r = &requests[i];
+            if (r->state == FETCH_STATE_WAITING && fetch_active_legs(requests, request_count) < FETCH_ENGINE_MAX_PRIMARY)
+            {
+                fetch_request_start(r);
+                progressed = true;
+            }
+            // Keep stepping a request while it is making progress
+            while (fetch_request_step(r, fetch_active_legs(requests, request_count) < CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT))
+            {
+                progressed = true;
+            }
+            if (r->state != FETCH_STATE_DONE)
+                remaining++;
+        }
+
+        uint32_t heap_now = esp_get_free_heap_size();
+        if (heap_now < heap_min)
+            heap_min = heap_now;
+
+        if (remaining && !progressed)
+        {
+            // Sleep until one of the sockets is readable/writable or the poll interval passes.
+            // Decrypted bytes already buffered inside mbedtls don't show up on the socket.
+            fd_set read_fds;
+            fd_set write_fds;
+            int max_fd = -1;
+            bool buffered = false;
+            FD_ZERO(&read_fds);
+            FD_ZERO(&write_fds);
+            for (uint8_t i = 0; i < request_count; i++)
+            {
+                for (uint8_t j = 0; j < FETCH_LEGS; j++)
+                {
+                    fetch_leg_t * leg = &requests[i].legs[j];
+                    int fd;
+                    if (!fetch_leg_in_progress(leg) || leg->tls == NULL || esp_tls_get_conn_sockfd(leg->tls, &fd) != ESP_OK || fd < 0)
+                        continue;
+                    if (leg->state >= FETCH_LEG_HEADERS && esp_tls_get_bytes_avail(leg->tls) > 0)
+                        buffered = true;
+                    FD_SET(fd, &read_fds);
+                    if (leg->state == FETCH_LEG_SENDING)
+                        FD_SET(fd, &write_fds);
+                    if (fd > max_fd)
+                        max_fd = fd;
+                }
+            }
+            if (!buffered && max_fd >= 0)
+            {
+                struct timeval timeout = { .tv_sec = 0, .tv_usec = FETCH_ENGINE_SELECT_TIMEOUT_MS * 1000 };
+                select(max_fd + 1, &read_fds, &write_fds, NULL, &timeout);
+            }
+            else if (!buffered)
+            {
+                vTaskDelay(FETCH_ENGINE_SELECT_TIMEOUT_MS / portTICK_PERIOD_MS);
+            }
+        }
+    }
+    while (remaining);
+
+    fetch_log_batch_stats("Async", request_count, batch_start_us, heap_before, heap_min);
+}
+
+// Fetch and parse a batch, either concurrently or one request at a time with http_client
+void fetch_batch(fetch_request_t * requests, uint8_t request_count)
+{
+    if (request_count == 0)
+        return;
+
+    if (CONFIG_ESP_FETCH_ENGINE_ASYNC)
+    {
+        fetch_engine_run(requests, request_count);
+    }
+    else
+    {
+        int64_t batch_start_us = esp_timer_get_time();
+        uint32_t heap_before = esp_get_free_heap_size();
+        for (uint8_t i = 0; i < request_count; i++)
+        {
+            fetch_request_t * r = &requests[i];
+            size_t response_length;
+            char * response_buffer;
+            r->state = FETCH_STATE_DONE;
+            if (r->probing)
+            {
+                r->probing = false;
+                response_buffer = http_client_fetch(r->probe_url, &response_length);
+                bool has_results = probe_record(r->probe_stats, response_buffer, response_length);
+                free(response_buffer);
+                if (!has_results)
+                {
+                    freshness_record_check(r->got_unit_rate);
+                    continue;
+                }
+            }
+            if (r->matcher)
+            {
+                // The sequential path has the whole body already, so feed it in one go.
+                // Retry unusable responses like the engine does.
+                bool accepted = false;
+                while (!accepted && r->rejected < FETCH_MAX_REJECTED)
+                {
+                    response_buffer = http_client_fetch(r->url, &response_length);
+                    json_matcher_reset(r->matcher);
+                    if (json_matcher_feed(r->matcher, response_buffer, response_length) && json_matcher_done(r->matcher))
+                        accepted = r->matcher->on_complete(r->matcher);
+                    else
+                        ESP_LOGE(TAG_FE, "Invalid JSON from %s", r->url);
+                    fetch_cost_record(r->cost, response_length, r->matcher->parse_us);
+                    free(response_buffer);
+                    if (!accepted && ++r->rejected < FETCH_MAX_REJECTED)
+                        vTaskDelay(FETCH_ENGINE_RETRY_DELAY_US / 1000 / portTICK_PERIOD_MS);
+                }
+                if (!accepted)
+                    ESP_LOGE(TAG_FE, "Response rejected %d times, giving up until the next check: %s", r->rejected, r->url);
+                continue;
+            }
+            response_buffer = http_client_fetch(r->url, &response_length);
+            int64_t parse_start_us = esp_timer_get_time();
+            http_client_parse(response_buffer, r->tariff_type, r->agile_rates_ref, r->agile_validity_ref, r->got_unit_rate, r->unit_rate, r->got_tracker_tomorrow_rate, r->tracker_tomorrow_rate);
+            fetch_cost_record(r->cost, response_length, esp_timer_get_time() - parse_start_us);
+            if (r->probe_stats)
+            {
+                r->probe_stats->last_full_bytes = response_length;
+                r->probe_stats->last_full_parse_us = esp_timer_get_time() - parse_start_us;
+            }
+            free(response_buffer);
+        }
+        // The sequential path can't sample the heap mid-request, so only the end state is reported
+        uint32_t heap_after = esp_get_free_heap_size();
+        fetch_log_batch_stats("Sequential", request_count, batch_start_us, heap_before, heap_after < heap_before ? heap_after : heap_before);
+    }
+}
+
+// Task for testing the display task - disable get_unit_rates_task and enable this one to test extreme values
+void test_task(void * pvParameters)
+{
+    ESP_LOGI(TAG, "Test task started");
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    ESP_LOGI(TAG, "Test task: Wifi connected");
+    wifi_connected = true;
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    ESP_LOGI(TAG, "Test task: Time set");
+    timeSet = true;
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    
+    gas_unit_rate = 2.73;
+    got_gas_unit_rate = true;
+    ESP_LOGI(TAG, "Test task: Gas unit rate set %f", gas_unit_rate);
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    
+    elec_unit_rate = 16.5;
+    got_elec_unit_rate = true;
+    ESP_LOGI(TAG, "Test task: Elec unit rate set %f", elec_unit_rate);
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    
+    ESP_LOGI(TAG, "Test task: Unit rates unset");
+    got_gas_unit_rate = true;
+    got_elec_unit_rate = true;
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    
+    gas_unit_rate = 0.0;
+    got_gas_unit_rate = true;
     ESP_LOGI(TAG, "Test task: Gas unit rate set %f", gas_unit_rate);
     
     elec_unit_rate = -10000.1;
@@ -888,6 +2598,401 @@ void test_task(void * pvParameters)
     vTaskDelay(2000 / portTICK_PERIOD_MS);
 }
 
+// Check if all enabled unit rates have been obtained.
+// Tomorrow's rates don't need to be checked here as they are checked hourly elsewhere.
+bool got_all_enabled_unit_rates(void)
+{
+    return got_gas_unit_rate
+        && got_elec_unit_rate
+        && (got_gas_flex_unit_rate || !CONFIG_ESP_TARIFF_FLEX_ENABLE)
+        && (got_elec_flex_unit_rate || !CONFIG_ESP_TARIFF_FLEX_ENABLE)
+        && (got_elec_agile_unit_rate || !CONFIG_ESP_TARIFF_AGILE_ENABLE);
+}
+
+uint8_t get_health_state(void)
+{
+    if (!wifi_connected)
+        return HEALTH_NO_WIFI;
+    if (!timeSet)
+        return HEALTH_NO_TIME;
+    if (!got_all_enabled_unit_rates())
+        return HEALTH_NO_PRICES;
+    return HEALTH_OK;
+}
+
+/* On-device web server
+ *
+ * / serves the dashboard, which is embedded in flash already gzipped with a strong ETag.
+ * /api/freshness returns the freshness histograms and daily availability summaries.
+ * /api/rates returns the current rates and status as JSON.
+ * /events streams the same JSON to browser dashboards as Server-Sent Events. A small
+ * number of connections are held open and an event is pushed only when the rate store
+ * version, the current Agile slot or the health state changes. Each change is serialized
+ * once into a shared buffer which is then sent as-is to every subscriber.
+ */
+static const char *TAG_WEB = "WEB";
+
+#define STATUS_BUFFER_SIZE 1536
+#define STATUS_PUBLISH_INTERVAL_MS 1000
+#define SSE_KEEPALIVE_INTERVAL_MS 30000
+
+static const char *health_state_names[] = { "no_wifi", "no_time", "no_prices", "ok" };
+
+static httpd_handle_t web_server = NULL;
+static SemaphoreHandle_t status_mutex = NULL;
+// SSE frame for the latest status; the JSON inside it is also served by /api/rates
+static char status_buffer[STATUS_BUFFER_SIZE];
+static size_t status_length = 0;
+static size_t status_json_offset = 0;
+static size_t status_json_length = 0;
+static int sse_clients[CONFIG_ESP_SSE_MAX_CLIENTS];
+static sse_fanout_t sse_fanout;
+static uint32_t status_serializations = 0;
+
+#ifndef DASHBOARD_ETAG
+#define DASHBOARD_ETAG "0"
+#endif
+// Strong validator: the dashboard only changes when the firmware does
+static const char dashboard_etag[] = "\"" DASHBOARD_ETAG "\"";
+static uint32_t dashboard_loads = 0;
+static uint32_t dashboard_not_modified = 0;
+static uint32_t dashboard_bytes_served = 0;
+static int64_t dashboard_max_latency_us = 0;
+
+typedef struct {
+    char * buf;
+    size_t size;
+    size_t len;
+} text_buffer_t;
+
+void text_append(text_buffer_t * text, const char * format, ...)
+{
+    va_list args;
+    if (text->len >= text->size)
+        return;
+    va_start(args, format);
+    int n = vsnprintf(text->buf + text->len, text->size - text->len, format, args);
+    va_end(args);
+    if (n > 0)
+        text->len = (text->len + n < text->size) ? text->len + n : text->size - 1;
+}
+
+void text_append_rate(text_buffer_t * text, bool valid, double rate)
+{
+    if (valid)
+        text_append(text, "%.2f", rate);
+    else
+        text_append(text, "null");
+}
+
+// Serialize the current rates and status into status_buffer as an SSE frame
+void status_serialize(uint32_t version, uint8_t slot, uint8_t health)
+{
+    text_buffer_t text = { .buf = status_buffer, .size = sizeof(status_buffer), .len = 0 };
+    
+    text_append(&text, "event: status\ndata: ");
+    status_json_offset = text.len;
+    text_append(&text, "{\"version\":%lu,\"time\":%lld,\"slot\":%d,\"health\":\"%s\"", version, (long long)time(NULL), slot, health_state_names[health]);
+    text_append(&text, ",\"tracker\":{\"elec\":");
+    text_append_rate(&text, got_elec_unit_rate, elec_unit_rate);
+    text_append(&text, ",\"gas\":");
+    text_append_rate(&text, got_gas_unit_rate, gas_unit_rate);
+    text_append(&text, ",\"elec_tomorrow\":");
+    text_append_rate(&text, got_elec_tomorrow_unit_rate, elec_tomorrow_unit_rate);
+    text_append(&text, ",\"gas_tomorrow\":");
+    text_append_rate(&text, got_gas_tomorrow_unit_rate, gas_tomorrow_unit_rate);
+    text_append(&text, "}");
+    if (CONFIG_ESP_TARIFF_FLEX_ENABLE)
+    {
+        text_append(&text, ",\"flex\":{\"elec\":");
+        text_append_rate(&text, got_elec_flex_unit_rate, elec_flex_unit_rate);
+        text_append(&text, ",\"gas\":");
+        text_append_rate(&text, got_gas_flex_unit_rate, gas_flex_unit_rate);
+        text_append(&text, "}");
+    }
+    if (CONFIG_ESP_TARIFF_AGILE_ENABLE)
+    {
+        text_append(&text, ",\"agile\":[");
+        for (uint8_t i = 0; i < 48; i++)
+        {
+            text_append(&text, i ? "," : "");
+            text_append_rate(&text, got_elec_agile_unit_rate && ((elec_agile_validity >> i) & 1), elec_agile_rates[i]);
+        }
+        text_append(&text, "]");
+    }
+    if (CONFIG_ESP_CARBON_INTENSITY_ENABLE && CONFIG_ESP_TARIFF_AGILE_ENABLE)
+    {
+        text_append(&text, ",\"carbon_intensity\":[");
+        for (uint8_t i = 0; i < 48; i++)
+        {
+            text_append(&text, i ? "," : "");
+            if (got_carbon_intensity && ((carbon_intensity_validity >> i) & 1))
+                text_append(&text, "%.0f", carbon_intensity_forecast[i]);
+            else
+                text_append(&text, "null");
+        }
+        text_append(&text, "],\"best_window\":");
+        if (best_window_start == BEST_WINDOW_NONE)
+            text_append(&text, "null");
+        else
+            text_append(&text, "{\"start\":%d,\"slots\":%d}", best_window_start, CONFIG_ESP_BEST_WINDOW_SLOTS);
+    }
+    text_append(&text, "}");
+    status_json_length = text.len - status_json_offset;
+    text_append(&text, "\n\n");
+    status_length = text.len;
+    status_serializations++;
+}
+
+int sse_send(void * ctx, int fd, const char * data, size_t length)
+{
+    return httpd_socket_send(web_server, fd, data, length, 0);
+}
+
+void sse_drop(void * ctx, int fd)
+{
+    ESP_LOGI(TAG_WEB, "SSE client %d dropped, %d remaining", fd, sse_fanout.count);
+    httpd_sess_trigger_close(web_server, fd);
+}
+
+// Runs in the web server task: send the status frame (or a keep-alive comment) to every subscriber
+void sse_broadcast_work(void * arg)
+{
+    bool keepalive = (arg != NULL);
+    static const char keepalive_frame[] = ": keepalive\n\n";
+    
+    xSemaphoreTake(status_mutex, portMAX_DELAY);
+    if (keepalive)
+        sse_fanout_broadcast(&sse_fanout, keepalive_frame, sizeof(keepalive_frame) - 1, false);
+    else
+        sse_fanout_broadcast(&sse_fanout, status_buffer, status_length, true);
+    xSemaphoreGive(status_mutex);
+}
+
+esp_err_t api_rates_handler(httpd_req_t * req)
+{
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    xSemaphoreTake(status_mutex, portMAX_DELAY);
+    esp_err_t err = httpd_resp_send(req, status_buffer + status_json_offset, status_json_length);
+    xSemaphoreGive(status_mutex);
+    return err;
+}
+
+void text_append_histogram(text_buffer_t * text, const uint32_t * histogram)
+{
+    text_append(text, "[");
+    for (uint8_t i = 0; i < FRESHNESS_HISTOGRAM_BUCKETS; i++)
+        text_append(text, i ? ",%lu" : "%lu", histogram[i]);
+    text_append(text, "]");
+}
+
+void text_append_freshness_day(text_buffer_t * text, const freshness_day_t * day)
+{
+    text_append(text, "{\"yday\":%d", day->yday);
+    for (uint8_t state = 0; state < NUM_OF_AVAILABILITY_STATES; state++)
+    {
+        text_append(text, ",\"%s\":{\"seconds\":%llu,\"episodes\":%lu,\"episode_seconds\":", availability_state_names[state],
+            day->state_us[state] / 1000000, day->episodes[state]);
+        text_append_histogram(text, day->episode_histogram[state]);
+        text_append(text, "}");
+    }
+    text_append(text, "}");
+}
+
+// Freshness histograms and daily availability, see the freshness tracking section
+esp_err_t api_freshness_handler(httpd_req_t * req)
+{
+    static char buffer[4096];
+    static freshness_tariff_t tariffs[NUM_OF_FRESHNESS_TARIFFS];
+    static freshness_day_t today;
+    static freshness_day_t yesterday;
+    text_buffer_t text = { .buf = buffer, .size = sizeof(buffer), .len = 0 };
+    
+    // Handlers run one at a time in the server task, so the snapshot can be static
+    portENTER_CRITICAL(&freshness_lock);
+    memcpy(tariffs, freshness_tariffs, sizeof(tariffs));
+    today = freshness_today;
+    yesterday = freshness_yesterday;
+    uint8_t state = availability_state;
+    portEXIT_CRITICAL(&freshness_lock);
+    
+    text_append(&text, "{\"state\":\"%s\",\"tariffs\":{", availability_state_names[state]);
+    for (uint8_t i = 0; i < NUM_OF_FRESHNESS_TARIFFS; i++)
+    {
+        const freshness_tariff_t * t = &tariffs[i];
+        text_append(&text, "%s\"%s\":{\"updates\":%lu,\"first_seen\":%lld,\"displayed\":%lld,\"last_checked\":%lld,\"discovery_seconds\":",
+            i ? "," : "", t->name, t->updates, (long long)t->first_seen, (long long)t->displayed, (long long)t->last_checked);
+        text_append_histogram(&text, t->discovery_histogram);
+        text_append(&text, ",\"frame_ms\":");
+        text_append_histogram(&text, t->frame_histogram);
+        text_append(&text, "}");
+    }
+    text_append(&text, "},\"today\":");
+    text_append_freshness_day(&text, &today);
+    text_append(&text, ",\"yesterday\":");
+    text_append_freshness_day(&text, &yesterday);
+    text_append(&text, "}");
+    
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, buffer, text.len);
+}
+
+// Serve the pre-compressed dashboard straight from flash. Browsers that already have it get a 304.
+esp_err_t dashboard_handler(httpd_req_t * req)
+{
+    int64_t start_us = esp_timer_get_time();
+    char if_none_match[sizeof(dashboard_etag) + 8];
+    size_t length = dashboard_gz_end - dashboard_gz_start;
+    esp_err_t err;
+    
+    httpd_resp_set_hdr(req, "ETag", dashboard_etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK
+        && strcmp(if_none_match, dashboard_etag) == 0)
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        err = httpd_resp_send(req, NULL, 0);
+        dashboard_not_modified++;
+        length = 0;
+    }
+    else
+    {
+        httpd_resp_set_type(req, "text/html");
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        err = httpd_resp_send(req, dashboard_gz_start, length);
+        dashboard_loads++;
+        dashboard_bytes_served += length;
+    }
+    
+    int64_t latency_us = esp_timer_get_time() - start_us;
+    if (latency_us > dashboard_max_latency_us)
+        dashboard_max_latency_us = latency_us;
+    ESP_LOGI(TAG_WEB, "Dashboard: %u bytes in %lld us (max %lld us), %lu full loads, %lu not modified, %lu bytes total",
+        length, latency_us, dashboard_max_latency_us, dashboard_loads, dashboard_not_modified, dashboard_bytes_served);
+    return err;
+}
+
+// Subscribe to status events. The response is written directly to the socket and left open.
+esp_err_t events_handler(httpd_req_t * req)
+{
+    static const char sse_headers[] = "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n\r\n";
+    int fd = httpd_req_to_sockfd(req);
+    
+    xSemaphoreTake(status_mutex, portMAX_DELAY);
+    if (sse_fanout.count >= sse_fanout.capacity)
+    {
+        xSemaphoreGive(status_mutex);
+        ESP_LOGW(TAG_WEB, "Too many SSE clients, refusing %d", fd);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Too many clients", HTTPD_RESP_USE_STRLEN);
+    }
+    if (httpd_send(req, sse_headers, sizeof(sse_headers) - 1) < 0
+        || (status_length > 0 && httpd_send(req, status_buffer, status_length) < 0))
+    {
+        xSemaphoreGive(status_mutex);
+        return ESP_FAIL;
+    }
+    sse_fanout_add(&sse_fanout, fd);
+    xSemaphoreGive(status_mutex);
+    ESP_LOGI(TAG_WEB, "SSE client %d subscribed, %d total", fd, sse_fanout.count);
+    return ESP_OK;
+}
+
+// Called by the web server whenever a session closes, including SSE subscribers going away
+void web_server_close_fn(httpd_handle_t hd, int sockfd)
+{
+    xSemaphoreTake(status_mutex, portMAX_DELAY);
+    if (sse_fanout_remove(&sse_fanout, sockfd))
+        ESP_LOGI(TAG_WEB, "SSE client %d removed, %d remaining", sockfd, sse_fanout.count);
+    xSemaphoreGive(status_mutex);
+    close(sockfd);
+}
+
+/* Every socket the firmware can have open at once has to fit within LWIP_MAX_SOCKETS
+ * (raised to 16 in sdkconfig.defaults). The web server keeps three of its own on top of
+ * max_open_sockets and refuses to start if they don't fit. Fetches use one socket each,
+ * and syslog and OTA updates one each.
+ */
+#define WEB_SERVER_SOCKETS (CONFIG_ESP_WEB_SERVER_ENABLE ? CONFIG_ESP_SSE_MAX_CLIENTS + 2 + 3 : 0)
+#define FETCH_SOCKETS (CONFIG_ESP_FETCH_ENGINE_ASYNC ? CONFIG_ESP_FETCH_ENGINE_MAX_CONCURRENT : 1)
+_Static_assert(WEB_SERVER_SOCKETS + FETCH_SOCKETS + CONFIG_ESP_SYSLOG_ENABLE + CONFIG_ESP_OTA_ENABLE <= CONFIG_LWIP_MAX_SOCKETS,
+    "Too many sockets for LWIP_MAX_SOCKETS: raise it or lower the SSE client or concurrent fetch limits");
+
+void web_server_start(void)
+{
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    // Room for every subscriber plus ordinary requests; subscribers must not be purged
+    config.max_open_sockets = CONFIG_ESP_SSE_MAX_CLIENTS + 2;
+    config.lru_purge_enable = false;
+    config.close_fn = web_server_close_fn;
+    config.core_id = 0;
+    
+    if (httpd_start(&web_server, &config) != ESP_OK)
+    {
+        ESP_LOGE(TAG_WEB, "Failed to start web server");
+        web_server = NULL;
+        return;
+    }
+    const httpd_uri_t dashboard_uri = { .uri = "/", .method = HTTP_GET, .handler = dashboard_handler };
+    const httpd_uri_t rates_uri = { .uri = "/api/rates", .method = HTTP_GET, .handler = api_rates_handler };
+    const httpd_uri_t freshness_uri = { .uri = "/api/freshness", .method = HTTP_GET, .handler = api_freshness_handler };
+    const httpd_uri_t events_uri = { .uri = "/events", .method = HTTP_GET, .handler = events_handler };
+    httpd_register_uri_handler(web_server, &dashboard_uri);
+    httpd_register_uri_handler(web_server, &rates_uri);
+    httpd_register_uri_handler(web_server, &freshness_uri);
+    httpd_register_uri_handler(web_server, &events_uri);
+    ESP_LOGI(TAG_WEB, "Web server started");
+}
+
+// Re-serialize the status when anything shown on it changes and push it to SSE subscribers
+void status_publisher_task(void * pvParameters)
+{
+    uint32_t version_last = 0;
+    uint8_t slot_last = 0;
+    uint8_t health_last = 0;
+    bool published = false;
+    uint32_t keepalive_counter = 0;
+    
+    while(1)
+    {
+        uint32_t version = rate_store_version;
+        uint8_t slot = agile_time;
+        uint8_t health = get_health_state();
+        
+        if (!published || version != version_last || slot != slot_last || health != health_last)
+        {
+            xSemaphoreTake(status_mutex, portMAX_DELAY);
+            status_serialize(version, slot, health);
+            xSemaphoreGive(status_mutex);
+            version_last = version;
+            slot_last = slot;
+            health_last = health;
+            published = true;
+            keepalive_counter = 0;
+            if (web_server && sse_fanout.count)
+                httpd_queue_work(web_server, sse_broadcast_work, NULL);
+            ESP_LOGI(TAG_WEB, "Status v%lu slot %d health %s: %u bytes, %lu serializations, %lu events sent to %d clients",
+                version, slot, health_state_names[health], status_length, status_serializations, sse_fanout.events_sent, sse_fanout.count);
+        }
+        else if (++keepalive_counter >= SSE_KEEPALIVE_INTERVAL_MS / STATUS_PUBLISH_INTERVAL_MS)
+        {
+            // Lets subscribers that have gone away be noticed and closed
+            keepalive_counter = 0;
+            if (web_server && sse_fanout.count)
+                httpd_queue_work(web_server, sse_broadcast_work, (void *)1);
+        }
+        vTaskDelay(STATUS_PUBLISH_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+}
+
 // Task for connecting to wifi and getting unit rates
 void get_unit_rates_task(void * pvParameters)
 {
@@ -897,6 +3002,31 @@ void get_unit_rates_task(void * pvParameters)
     uint8_t day_last;
     struct tm time_struct;
     char url[255];
+    // Static to keep the batch off the task stack
+    static fetch_request_t requests[FETCH_ENGINE_MAX_REQUESTS];
+    uint8_t request_count;
+    // Set hourly while waiting for newly published rates; the rates already obtained stay
+    // on the display and a probe decides whether the full rate list needs downloading
+    char probe_url[255];
+    bool elec_probe_due = false;
+    bool gas_probe_due = false;
+    bool agile_probe_due = false;
+    // Set hourly as the carbon intensity forecast is revised through the day
+    bool carbon_intensity_due = false;
+    static fetch_probe_stats_t elec_probe_stats = { .name = "Tracker elec" };
+    static fetch_probe_stats_t gas_probe_stats = { .name = "Tracker gas" };
+    static fetch_probe_stats_t agile_probe_stats = { .name = "Agile elec" };
+    // Flexible rates can come from one product detail request instead of one per fuel
+    static json_matcher_t flex_matcher;
+    static char flex_elec_path[JSON_MATCHER_PATH_SIZE];
+    static char flex_gas_path[JSON_MATCHER_PATH_SIZE];
+    static fetch_cost_t flex_detail_cost = { .name = "Flexible (product detail)" };
+    static fetch_cost_t flex_rates_cost = { .name = "Flexible (unit rates)" };
+    // Fetch the Flexible rates both ways on the first pass so they can be compared in the log
+    bool flex_compare = CONFIG_ESP_FLEX_COMPARE_ONCE;
+    struct tm active_at_struct;
+    
+    flexible_product_matcher_init(&flex_matcher, flex_elec_path, flex_gas_path, sizeof(flex_elec_path), flexible_product_apply);
     
     while(1)
     {
@@ -906,6 +3036,11 @@ void get_unit_rates_task(void * pvParameters)
             ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
             wifi_init_sta();
         }
+        
+        if (CONFIG_ESP_WEB_SERVER_ENABLE && web_server == NULL && wifi_connected)
+        {
+            web_server_start();
+        }
 
         // Tracker tariff
         // Get tariff information
@@ -913,22 +3048,33 @@ void get_unit_rates_task(void * pvParameters)
         ESP_LOGI(TAG, "Elec tariff=%s",CONFIG_ESP_TARIFF_ELEC);
         ESP_LOGI(TAG, "Gas tariff=%s",CONFIG_ESP_TARIFF_GAS);
         
-        if (!got_elec_unit_rate)
+        // Requests are collected into a batch and fetched together so that
+        // they can run concurrently when the async fetch engine is enabled
+        request_count = 0;
+        
+        if (!got_elec_unit_rate || elec_probe_due)
         {
             // Generate url for elec tariff api
-            sprintf(url, "https://api.octopus.energy/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_TARIFF, CONFIG_ESP_TARIFF_ELEC);
+            sprintf(url, "%s/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF, CONFIG_ESP_TARIFF_ELEC);
             ESP_LOGI(TAG, "url=%s",url);
-            // Do HTTP request and parse
-            http_client(url, TARIFF_TYPE_TRACKER, NULL, NULL, &got_elec_unit_rate, &elec_unit_rate, &got_elec_tomorrow_unit_rate, &elec_tomorrow_unit_rate); 
+            if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_TRACKER, NULL, NULL, &got_elec_unit_rate, &elec_unit_rate, &got_elec_tomorrow_unit_rate, &elec_tomorrow_unit_rate))
+            {
+                // Tomorrow's rate is the one valid this time tomorrow
+                probe_url_for(probe_url, sizeof(probe_url), url, time(NULL) + 86400);
+                fetch_request_set_probe(&requests[request_count - 1], &elec_probe_stats, got_elec_unit_rate ? probe_url : NULL);
+            }
         }
         
-        if (!got_gas_unit_rate)
+        if (!got_gas_unit_rate || gas_probe_due)
         {
             // Generate url for gas tariff api
-            sprintf(url, "https://api.octopus.energy/v1/products/%s/gas-tariffs/%s/standard-unit-rates/", CONFIG_ESP_TARIFF, CONFIG_ESP_TARIFF_GAS);
+            sprintf(url, "%s/v1/products/%s/gas-tariffs/%s/standard-unit-rates/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF, CONFIG_ESP_TARIFF_GAS);
             ESP_LOGI(TAG, "url=%s",url);
-            // Do HTTP request and parse
-            http_client(url, TARIFF_TYPE_TRACKER, NULL, NULL, &got_gas_unit_rate, &gas_unit_rate, &got_gas_tomorrow_unit_rate, &gas_tomorrow_unit_rate);
+            if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_TRACKER, NULL, NULL, &got_gas_unit_rate, &gas_unit_rate, &got_gas_tomorrow_unit_rate, &gas_tomorrow_unit_rate))
+            {
+                probe_url_for(probe_url, sizeof(probe_url), url, time(NULL) + 86400);
+                fetch_request_set_probe(&requests[request_count - 1], &gas_probe_stats, got_gas_unit_rate ? probe_url : NULL);
+            }
         }
         
         // Flexible tariff
@@ -939,37 +3085,90 @@ void get_unit_rates_task(void * pvParameters)
             ESP_LOGI(TAG, "Elec tariff=%s",CONFIG_ESP_TARIFF_ELEC_FLEX);
             ESP_LOGI(TAG, "Gas tariff=%s",CONFIG_ESP_TARIFF_GAS_FLEX);
             
-            if (!got_elec_flex_unit_rate)
+            if ((CONFIG_ESP_FLEX_PRODUCT_DETAIL && (!got_elec_flex_unit_rate || !got_gas_flex_unit_rate)) || flex_compare)
+            {
+                // The product detail gives the rates of every tariff active at the given time
+                time_now = time(NULL);
+                gmtime_r(&time_now, &active_at_struct);
+                int url_len = sprintf(url, "%s/v1/products/%s/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF_FLEX);
+                strftime(url + url_len, sizeof(url) - url_len, "?tariffs_active_at=%Y-%m-%dT%H:%M:%SZ", &active_at_struct);
+                ESP_LOGI(TAG, "url=%s",url);
+                if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_FLEXIBLE, NULL, NULL, NULL, NULL, NULL, NULL))
+                {
+                    fetch_request_set_matcher(&requests[request_count - 1], &flex_matcher);
+                    fetch_request_set_cost(&requests[request_count - 1], &flex_detail_cost);
+                }
+            }
+            
+            if ((!CONFIG_ESP_FLEX_PRODUCT_DETAIL && !got_elec_flex_unit_rate) || flex_compare)
             {
                 // Generate url for elec tariff api
-                sprintf(url, "https://api.octopus.energy/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_TARIFF_FLEX, CONFIG_ESP_TARIFF_ELEC_FLEX);
+                sprintf(url, "%s/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF_FLEX, CONFIG_ESP_TARIFF_ELEC_FLEX);
                 ESP_LOGI(TAG, "url=%s",url);
-                // Do HTTP request and parse
-                http_client(url, TARIFF_TYPE_FLEXIBLE, NULL, NULL, &got_elec_flex_unit_rate, &elec_flex_unit_rate, NULL, NULL); 
+                if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_FLEXIBLE, NULL, NULL, &got_elec_flex_unit_rate, &elec_flex_unit_rate, NULL, NULL))
+                    fetch_request_set_cost(&requests[request_count - 1], &flex_rates_cost);
             }
             
-            if (!got_gas_flex_unit_rate)
+            if ((!CONFIG_ESP_FLEX_PRODUCT_DETAIL && !got_gas_flex_unit_rate) || flex_compare)
             {
                 // Generate url for gas tariff api
-                sprintf(url, "https://api.octopus.energy/v1/products/%s/gas-tariffs/%s/standard-unit-rates/", CONFIG_ESP_TARIFF_FLEX, CONFIG_ESP_TARIFF_GAS_FLEX);
+                sprintf(url, "%s/v1/products/%s/gas-tariffs/%s/standard-unit-rates/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF_FLEX, CONFIG_ESP_TARIFF_GAS_FLEX);
                 ESP_LOGI(TAG, "url=%s",url);
-                // Do HTTP request and parse
-                http_client(url, TARIFF_TYPE_FLEXIBLE, NULL, NULL, &got_gas_flex_unit_rate, &gas_flex_unit_rate, NULL, NULL);
+                if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_FLEXIBLE, NULL, NULL, &got_gas_flex_unit_rate, &gas_flex_unit_rate, NULL, NULL))
+                    fetch_request_set_cost(&requests[request_count - 1], &flex_rates_cost);
             }
         }
         
         // Agile tariff
-        if (CONFIG_ESP_TARIFF_AGILE_ENABLE && !got_elec_agile_unit_rate)
+        if (CONFIG_ESP_TARIFF_AGILE_ENABLE && (!got_elec_agile_unit_rate || agile_probe_due))
         {
             // Get tariff information
             // Print tariff names in debug console
             ESP_LOGI(TAG, "Elec tariff=%s",CONFIG_ESP_TARIFF_ELEC_AGILE);
             // Generate url for elec tariff api
-            sprintf(url, "https://api.octopus.energy/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_TARIFF_AGILE, CONFIG_ESP_TARIFF_ELEC_AGILE);
+            sprintf(url, "%s/v1/products/%s/electricity-tariffs/%s/standard-unit-rates/", CONFIG_ESP_OCTOPUS_API_URL, CONFIG_ESP_TARIFF_AGILE, CONFIG_ESP_TARIFF_ELEC_AGILE);
+            ESP_LOGI(TAG, "url=%s",url);
+            if (fetch_request_add(requests, &request_count, url, TARIFF_TYPE_AGILE, elec_agile_rates, &elec_agile_validity, &got_elec_agile_unit_rate, NULL, NULL, NULL))
+            {
+                // Probe for the second half-hour of the current hour, one minute in so the
+                // slot before it (which ends on the boundary) isn't matched
+                time_now = time(NULL);
+                probe_url_for(probe_url, sizeof(probe_url), url, time_now - (time_now % 3600) + 1800 + 60);
+                fetch_request_set_probe(&requests[request_count - 1], &agile_probe_stats, got_elec_agile_unit_rate ? probe_url : NULL);
+            }
+        }
+        
+        // Carbon intensity forecast, shown alongside the Agile price
+        if (CONFIG_ESP_CARBON_INTENSITY_ENABLE && CONFIG_ESP_TARIFF_AGILE_ENABLE && (!got_carbon_intensity || carbon_intensity_due))
+        {
+            // /intensity/date runs from the day before's 23:30Z slot to 23:00Z, missing today's
+            // last slot, so ask for a range into tomorrow instead. Slots that aren't today (UTC)
+            // are skipped when parsing.
+            struct tm day_struct;
+            time_now = time(NULL);
+            time_t time_tomorrow = time_now + 86400;
+            int url_len = sprintf(url, "https://%s/intensity/", CARBON_INTENSITY_HOST);
+            gmtime_r(&time_now, &day_struct);
+            url_len += strftime(url + url_len, sizeof(url) - url_len, "%Y-%m-%dT00:00Z/", &day_struct);
+            gmtime_r(&time_tomorrow, &day_struct);
+            strftime(url + url_len, sizeof(url) - url_len, "%Y-%m-%dT00:30Z", &day_struct);
             ESP_LOGI(TAG, "url=%s",url);
-            // Do HTTP request and parse
-            http_client(url, TARIFF_TYPE_AGILE, elec_agile_rates, &elec_agile_validity, &got_elec_agile_unit_rate, NULL, NULL, NULL); 
+            fetch_request_add(requests, &request_count, url, TARIFF_TYPE_CARBON_INTENSITY, carbon_intensity_forecast, &carbon_intensity_validity, &got_carbon_intensity, NULL, NULL, NULL);
+        }
+        
+        // Do HTTP requests and parse
+        fetch_batch(requests, request_count);
+        elec_probe_due = false;
+        gas_probe_due = false;
+        agile_probe_due = false;
+        carbon_intensity_due = false;
+        if (flex_compare && CONFIG_ESP_TARIFF_FLEX_ENABLE)
+        {
+            fetch_cost_log_comparison(&flex_detail_cost, &flex_rates_cost);
         }
+        flex_compare = false;
+        fetch_cost_log(&flex_detail_cost);
+        fetch_cost_log(&flex_rates_cost);
         
         
         ESP_LOGI(TAG, "Reached the end");
@@ -981,6 +3180,8 @@ void get_unit_rates_task(void * pvParameters)
         ESP_LOGI(TAG, "hour_last set to %d", hour_last);
         ESP_LOGI(TAG, "day_last set to %d", day_last);
         agile_time = (time_struct.tm_hour * 2) + (time_struct.tm_min / 30);
+        if (CONFIG_ESP_CARBON_INTENSITY_ENABLE && CONFIG_ESP_TARIFF_AGILE_ENABLE)
+            best_window_update();
     
         while(1)
         {
@@ -991,6 +3192,8 @@ void get_unit_rates_task(void * pvParameters)
             time_now = time(NULL);
             gmtime_r(&time_now, &time_struct);
             agile_time = (time_struct.tm_hour * 2) + (time_struct.tm_min / 30);
+            if (CONFIG_ESP_CARBON_INTENSITY_ENABLE && CONFIG_ESP_TARIFF_AGILE_ENABLE)
+                best_window_update();
             if (time_struct.tm_hour != hour_last)
             {
                 // Move the got_x_rate statements here to always refresh prices hourly instead.
@@ -1004,21 +3207,23 @@ void get_unit_rates_task(void * pvParameters)
                     got_gas_flex_unit_rate = false;
                     got_elec_flex_unit_rate = false;
                     got_elec_agile_unit_rate = false;
+                    got_carbon_intensity = false;
                 }
                 // New API should never return incorrect prices when the new price is not
                 // yet available, but tomorrow's price for the tracker doesn't appear until
                 // some time later in the day so we need to check hourly until those appear.
                 if ((got_gas_tomorrow_unit_rate == false) || (got_elec_tomorrow_unit_rate == false))
                 {
-                    got_gas_unit_rate = false;
-                    got_elec_unit_rate = false;
+                    gas_probe_due = true;
+                    elec_probe_due = true;
                 }
                 // The agile prices for the last hour of the day are not always available
                 // so refresh the prices if the agile prices for the new hour are not valid
                 if (((elec_agile_validity >> (time_struct.tm_hour * 2)) & 0b11) != 0b11)
                 {
-                    got_elec_agile_unit_rate = false;
+                    agile_probe_due = true;
                 }
+                carbon_intensity_due = true;
                 break;
             }
         }
@@ -1079,20 +3284,114 @@ void get_display_digits(double value, uint8_t * display_digits, uint32_t * dp_po
     }
 }
 
-// Callback for Timer Interrupt - displays the next digit on the 7-segment display on each run
-static bool IRAM_ATTR timer_group_isr_callback(void *args)
+/* Frame composer
+ *
+ * Works out what every logical display should show, then places each one on its physical
+ * digits using the layout table and converts the digits into segment patterns.
+ * Runs in display_task; the composed frame is handed to the display backend, which
+ * only has anything to do when the frame has changed.
+ */
+#define DISPLAY_COMPOSE_INTERVAL_MS 20
+
+// Logical displays, each made of three digits
+typedef enum {
+    DISPLAY_RIGHT_GAS,          // Tomorrow's (or today's) Tracker gas, blank when Agile is shown
+    DISPLAY_RIGHT_ELEC,         // Tomorrow's (or today's) Tracker elec, or Agile
+    DISPLAY_LEFT_GAS,           // Today's Tracker gas, or Flexible
+    DISPLAY_LEFT_ELEC,          // Today's Tracker elec, or Flexible
+    DISPLAY_ALT_RIGHT_GAS,      // Lower half of the full board: what the four above show while button 2 is held
+    DISPLAY_ALT_RIGHT_ELEC,
+    DISPLAY_ALT_LEFT_GAS,
+    DISPLAY_ALT_LEFT_ELEC,
+    NUM_OF_LOGICAL_DISPLAYS
+} logical_display_t;
+
+typedef struct {
+    uint8_t digits[3];          // Indexes into segment_patterns
+    uint8_t decimal_points;     // Bit 0 = first digit
+} display_value_t;
+
+#define DISPLAY_LAYOUT_BREAKAWAY 0
+#define DISPLAY_LAYOUT_FULL 1
+
+static const display_position_t display_layout[NUM_OF_LOGICAL_DISPLAYS] = {
+    [DISPLAY_RIGHT_GAS]      = { 0, 0 },
+    [DISPLAY_RIGHT_ELEC]     = { 3, 0 },
+    [DISPLAY_LEFT_GAS]       = { 0, 1 },
+    [DISPLAY_LEFT_ELEC]      = { 3, 1 },
+#if CONFIG_ESP_DISPLAY_LAYOUT == DISPLAY_LAYOUT_FULL
+    [DISPLAY_ALT_RIGHT_GAS]  = { 8, 0 },
+    [DISPLAY_ALT_RIGHT_ELEC] = { 11, 0 },
+    [DISPLAY_ALT_LEFT_GAS]   = { 8, 1 },
+    [DISPLAY_ALT_LEFT_ELEC]  = { 11, 1 },
+#else
+    [DISPLAY_ALT_RIGHT_GAS]  = { DISPLAY_UNUSED, 0 },
+    [DISPLAY_ALT_RIGHT_ELEC] = { DISPLAY_UNUSED, 0 },
+    [DISPLAY_ALT_LEFT_GAS]   = { DISPLAY_UNUSED, 0 },
+    [DISPLAY_ALT_LEFT_ELEC]  = { DISPLAY_UNUSED, 0 },
+#endif
+};
+
+// Show a unit rate if it's available, otherwise the dashes pattern for the self-diagnostics
+// Returns true if the rate is shown, false if dashes are shown instead
+bool display_show_rate(display_value_t * value, bool available, double rate, bool got_rate)
 {
-    static uint8_t display_digits[NUM_OF_ANODES * 2] = {0,1,2,3,4,5,6,7,8,9,0,1,2,3,4,5,6,7,8,9,0,1,2,3,4,5,6,7,8,9,0,1};
-    static uint8_t display_segments[NUM_OF_ANODES * 2];
-    static uint32_t decimal_points = 0;
-    const uint8_t segment_patterns[12] = {0b00111111, 0b00000110, 0b01011011, 0b01001111, 0b01100110, 0b01101101, 0b01111100, 0b00000111, 0b01111111, 0b01100111, 0b00000000, 0b01000000};
-    static uint8_t current_disp_index = 0;
-    static uint8_t dim_cycle_counter = 0;
     uint32_t dp_temp;
-    bool button2_held = !gpio_get_level(pin_BUTTON2);
-    //bool button3_held = !gpio_get_level(pin_BUTTON3);
+    if (timeSet && wifi_connected && available)
+    {
+        get_display_digits(rate, value->digits, &dp_temp);
+        value->decimal_points = dp_temp;
+        return true;
+    }
+    else
+    {
+        // generate dashes pattern
+        value->digits[0] = wifi_connected ? 0xB : 0xA;
+        value->digits[1] = timeSet ? 0xB : 0xA;
+        value->digits[2] = got_rate ? 0xB : 0xA;
+        value->decimal_points = 0;
+        return false;
+    }
+}
+
+// Show a carbon intensity in gCO2/kWh as a whole number, with the last decimal point lit
+// during the cheapest and greenest window
+bool display_show_intensity(display_value_t * value, bool available, double intensity, bool got_intensity, bool in_best_window)
+{
+    if (!(timeSet && wifi_connected && available))
+        return display_show_rate(value, false, 0.0, got_intensity);
+    uint16_t whole = (intensity < 0.0) ? 0 : (intensity > 999.0) ? 999 : (uint16_t)(intensity + 0.5);
+    value->digits[0] = (whole >= 100) ? whole / 100 : 10;
+    value->digits[1] = (whole >= 10) ? whole / 10 % 10 : 10;
+    value->digits[2] = whole % 10;
+    value->decimal_points = in_best_window ? 4 : 0;
+    return true;
+}
+
+void display_show_blank(display_value_t * value)
+{
+    value->digits[0] = 10;
+    value->digits[1] = 10;
+    value->digits[2] = 10;
+    value->decimal_points = 0;
+}
+
+// Mark tariff as drawn in the frame if its rate is shown; passes shown through
+bool display_drawn(uint8_t * drawn, uint8_t tariff, bool shown)
+{
+    if (shown)
+        *drawn |= 1 << tariff;
+    return shown;
+}
+
+// Fill in right gas, right elec, left gas and left elec for the normal or button 2 view.
+// Returns true if every rate in the view is shown. Sets a bit in drawn (1 << FRESHNESS_*)
+// for each tariff whose rate is shown.
+bool display_compose_view(bool button2_held, display_value_t * values, uint8_t * drawn)
+{
     bool display_agile = 0;
     bool display_flex = 0;
+    bool shown = true;
     
     if (CONFIG_ESP_TARIFF_TOMORROW_ENABLE == 0 && CONFIG_ESP_TARIFF_FLEX_ENABLE)
     {
@@ -1111,176 +3410,258 @@ static bool IRAM_ATTR timer_group_isr_callback(void *args)
         display_agile = button2_held;
     }
     
-    // If first digit is about to be displayed, update display data
-    if ((current_disp_index == 0) && (dim_cycle_counter == 0))
+    // Right hand displays
+    if (display_agile)
     {
-        decimal_points = 0;
-        // Right hand displays
-        if (display_agile)
+        // Gas - not applicable to agile, so show the carbon intensity there if enabled
+        if (CONFIG_ESP_CARBON_INTENSITY_ENABLE)
         {
-            // Gas - not applicable to agile
-            display_digits[0] = 10;
-            display_digits[1] = 10;
-            display_digits[2] = 10;
-            
-            
-            if (timeSet && wifi_connected && got_elec_agile_unit_rate && ((elec_agile_validity >> agile_time) & 1))
-            {
-                // Electricity
-                get_display_digits(elec_agile_rates[agile_time], &display_digits[3], &dp_temp);
-                
-                decimal_points |= dp_temp << 3;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[3] = wifi_connected ? 0xB : 0xA;
-                display_digits[4] = timeSet ? 0xB : 0xA;
-                display_digits[5] = got_elec_agile_unit_rate ? 0xB : 0xA;
-            }
-
+            uint8_t best = best_window_start;
+            shown &= display_drawn(drawn, FRESHNESS_CARBON_INTENSITY,
+                display_show_intensity(&values[DISPLAY_RIGHT_GAS], got_carbon_intensity && ((carbon_intensity_validity >> agile_time) & 1),
+                    carbon_intensity_forecast[agile_time], got_carbon_intensity,
+                    best != BEST_WINDOW_NONE && agile_time >= best && agile_time < best + CONFIG_ESP_BEST_WINDOW_SLOTS));
         }
-        else if (CONFIG_ESP_TARIFF_TOMORROW_ENABLE == 0)
+        else
         {
-            if (timeSet && wifi_connected && got_gas_unit_rate)
-            {
-                // Generate numeric digits
-                // Gas
-                get_display_digits(gas_unit_rate, &display_digits[0], &dp_temp);
-                
-                decimal_points |= dp_temp;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[0] = wifi_connected ? 0xB : 0xA;
-                display_digits[1] = timeSet ? 0xB : 0xA;
-                display_digits[2] = got_gas_unit_rate ? 0xB : 0xA;
-            }
-            
-            if (timeSet && wifi_connected && got_elec_unit_rate)
-            {
-                // Electricity
-                get_display_digits(elec_unit_rate, &display_digits[3], &dp_temp);
-                
-                decimal_points |= dp_temp << 3;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[3] = wifi_connected ? 0xB : 0xA;
-                display_digits[4] = timeSet ? 0xB : 0xA;
-                display_digits[5] = got_elec_unit_rate ? 0xB : 0xA;
-            }
+            display_show_blank(&values[DISPLAY_RIGHT_GAS]);
         }
-        else
+        shown &= display_drawn(drawn, FRESHNESS_AGILE_ELEC,
+            display_show_rate(&values[DISPLAY_RIGHT_ELEC], got_elec_agile_unit_rate && ((elec_agile_validity >> agile_time) & 1), elec_agile_rates[agile_time], got_elec_agile_unit_rate));
+    }
+    else if (CONFIG_ESP_TARIFF_TOMORROW_ENABLE == 0)
+    {
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_GAS, display_show_rate(&values[DISPLAY_RIGHT_GAS], got_gas_unit_rate, gas_unit_rate, got_gas_unit_rate));
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_ELEC, display_show_rate(&values[DISPLAY_RIGHT_ELEC], got_elec_unit_rate, elec_unit_rate, got_elec_unit_rate));
+    }
+    else
+    {
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_GAS, display_show_rate(&values[DISPLAY_RIGHT_GAS], got_gas_tomorrow_unit_rate, gas_tomorrow_unit_rate, got_gas_unit_rate));
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_ELEC, display_show_rate(&values[DISPLAY_RIGHT_ELEC], got_elec_tomorrow_unit_rate, elec_tomorrow_unit_rate, got_elec_unit_rate));
+    }
+    
+    // Left hand display
+    if (display_flex)
+    {
+        shown &= display_drawn(drawn, FRESHNESS_FLEX_GAS, display_show_rate(&values[DISPLAY_LEFT_GAS], got_gas_flex_unit_rate, gas_flex_unit_rate, got_gas_flex_unit_rate));
+        shown &= display_drawn(drawn, FRESHNESS_FLEX_ELEC, display_show_rate(&values[DISPLAY_LEFT_ELEC], got_elec_flex_unit_rate, elec_flex_unit_rate, got_elec_flex_unit_rate));
+    }
+    else
+    {
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_GAS, display_show_rate(&values[DISPLAY_LEFT_GAS], got_gas_unit_rate, gas_unit_rate, got_gas_unit_rate));
+        shown &= display_drawn(drawn, FRESHNESS_TRACKER_ELEC, display_show_rate(&values[DISPLAY_LEFT_ELEC], got_elec_unit_rate, elec_unit_rate, got_elec_unit_rate));
+    }
+    return shown;
+}
+
+// Returns true if every rate in the view currently selected by the buttons is shown.
+// drawn gets a bit (1 << FRESHNESS_*) for each tariff whose rate is in the frame.
+bool display_compose_frame(display_frame_t * frame, uint8_t * drawn)
+{
+    const uint8_t segment_patterns[12] = {0b00111111, 0b00000110, 0b01011011, 0b01001111, 0b01100110, 0b01101101, 0b01111100, 0b00000111, 0b01111111, 0b01100111, 0b00000000, 0b01000000};
+    display_value_t values[NUM_OF_LOGICAL_DISPLAYS];
+    bool button2_held = !gpio_get_level(pin_BUTTON2);
+    //bool button3_held = !gpio_get_level(pin_BUTTON3);
+    
+    uint8_t alt_drawn = 0;
+    
+    *drawn = 0;
+    bool shown = display_compose_view(button2_held, &values[DISPLAY_RIGHT_GAS], drawn);
+    display_compose_view(true, &values[DISPLAY_ALT_RIGHT_GAS], &alt_drawn);
+    // The alternative view is only in the frame if the layout has room for it
+    if (display_layout[DISPLAY_ALT_RIGHT_GAS].anode != DISPLAY_UNUSED)
+        *drawn |= alt_drawn;
+    
+    // Place each logical display on its digits; digits not in the layout stay blank
+    memset(frame, 0, sizeof(display_frame_t));
+    for (uint8_t display = 0; display < NUM_OF_LOGICAL_DISPLAYS; display++)
+    {
+        const display_position_t * position = &display_layout[display];
+        if (position->anode == DISPLAY_UNUSED)
+            continue;
+        for (uint8_t digit = 0; digit < 3; digit++)
         {
-            if (timeSet && wifi_connected && got_gas_tomorrow_unit_rate)
-            {
-                // Generate numeric digits
-                // Gas
-                get_display_digits(gas_tomorrow_unit_rate, &display_digits[0], &dp_temp);
-                
-                decimal_points |= dp_temp;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[0] = wifi_connected ? 0xB : 0xA;
-                display_digits[1] = timeSet ? 0xB : 0xA;
-                display_digits[2] = got_gas_unit_rate ? 0xB : 0xA;
-            }
-            
-            if (timeSet && wifi_connected && got_elec_tomorrow_unit_rate)
-            {
-                // Electricity
-                get_display_digits(elec_tomorrow_unit_rate, &display_digits[3], &dp_temp);
-                
-                decimal_points |= dp_temp << 3;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[3] = wifi_connected ? 0xB : 0xA;
-                display_digits[4] = timeSet ? 0xB : 0xA;
-                display_digits[5] = got_elec_unit_rate ? 0xB : 0xA;
-            }
+            uint8_t index = position->bank * NUM_OF_ANODES + position->anode + digit;
+            frame->segments[index] = segment_patterns[values[display].digits[digit]];
+            frame->decimal_points |= (uint32_t)((values[display].decimal_points >> digit) & 1) << index;
         }
+    }
+    return shown;
+}
+
+/* Display backends
+ *
+ * A backend takes composed frames and gets them onto the digits. The original board
+ * multiplexes the anodes in software from a timer ISR; boards with LED driver chips
+ * only need updating when a frame changes.
+ */
+typedef struct {
+    const char * name;
+    void (*init)(void);
+    bool (*push_frame)(const display_frame_t * frame);     // Returns false if the frame can't be taken yet
+    void (*set_brightness)(uint8_t brightness);            // 0 to NUMBER_OF_BRIGHTNESS_SETTINGS - 1
+} display_backend_t;
+
+#define DISPLAY_BACKEND_SCANNER 0
+#define DISPLAY_BACKEND_MAX7219 1
+
+/* ISR event channel
+ *
+ * The scan ISR can't log, so it reports what it sees through an isr_event_ring_t in
+ * internal RAM that a low priority task on core 0 drains. If the ring is full the new event
+ * is dropped and counted, so the ISR never waits and never calls into FreeRTOS. Late ticks
+ * and slow runs are only logged one by one up to ISR_EVENT_LOG_LIMIT per summary interval,
+ * so a burst of them doesn't flood the log; the summary line counts them all.
+ */
+static const char *TAG_ISR = "ISR";
+
+#define ISR_EVENT_DRAIN_INTERVAL_MS 100
+#define ISR_EVENT_SUMMARY_INTERVAL_MS 60000
+#define ISR_EVENT_LOG_LIMIT 5       // Overrun and slow warnings logged per summary interval
+#define ISR_TICK_US 200             // Matches the alarm interval given to example_timer_init
+#define ISR_SLOW_US 100             // ISR run time reported as an outlier
+
+#define ISR_EVENT_OVERRUN 0         // Time since the previous tick was well over ISR_TICK_US; value = cycles
+#define ISR_EVENT_FRAME_SWAP 1      // A new frame was picked up; arg = front frame
+#define ISR_EVENT_BUTTON 2          // Button level changed; arg = pin, value = new level
+#define ISR_EVENT_SLOW 3            // ISR ran longer than ISR_SLOW_US; value = cycles
+#define NUM_OF_ISR_EVENT_TYPES 4
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#define isr_cycle_count() esp_cpu_get_cycle_count()
+#else
+#define isr_cycle_count() cpu_hal_get_cycle_count()
+#endif
+
+static DRAM_ATTR isr_event_ring_t isr_event_ring;
+// Set before the timer starts
+static DRAM_ATTR uint32_t isr_cycles_per_us = 240;
+
+static const char *isr_event_names[] = { "overrun", "frame swap", "button", "slow" };
+
+static inline void IRAM_ATTR isr_event_put(uint8_t type, uint8_t arg, uint32_t value, uint32_t cycles)
+{
+    isr_event_ring_put(&isr_event_ring, type, arg, value, cycles);
+}
+
+void isr_event_task(void * pvParameters)
+{
+    isr_event_t event;
+    uint32_t counts[NUM_OF_ISR_EVENT_TYPES] = { 0 };
+    uint32_t max_slow_us = 0;
+    uint32_t max_interval_us = 0;
+    uint32_t dropped_reported = 0;
+    uint32_t summary_counter = 0;
+    uint32_t warnings_logged = 0;
+    
+    while(1)
+    {
+        vTaskDelay(ISR_EVENT_DRAIN_INTERVAL_MS / portTICK_PERIOD_MS);
         
-        // Left hand display
-        if (display_flex)
+        while (isr_event_ring_get(&isr_event_ring, &event))
         {
-            if (timeSet && wifi_connected && got_gas_flex_unit_rate)
-            {
-                // Generate numeric digits
-                // Gas
-                get_display_digits(gas_flex_unit_rate, &display_digits[16], &dp_temp);
-                
-                decimal_points |= dp_temp << 16;
-            }
-            else
+            uint32_t us = event.value / isr_cycles_per_us;
+            if (event.type >= NUM_OF_ISR_EVENT_TYPES)
+                continue;
+            counts[event.type]++;
+            switch (event.type)
             {
-                // generate dashes pattern
-                display_digits[16] = wifi_connected ? 0xB : 0xA;
-                display_digits[17] = timeSet ? 0xB : 0xA;
-                display_digits[18] = got_gas_flex_unit_rate ? 0xB : 0xA;
-            }
-            
-            if (timeSet && wifi_connected && got_elec_flex_unit_rate)
-            {
-                // Electricity
-                get_display_digits(elec_flex_unit_rate, &display_digits[19], &dp_temp);
-                
-                decimal_points |= dp_temp << 19;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[19] = wifi_connected ? 0xB : 0xA;
-                display_digits[20] = timeSet ? 0xB : 0xA;
-                display_digits[21] = got_elec_flex_unit_rate ? 0xB : 0xA;
+                case ISR_EVENT_OVERRUN:
+                    if (us > max_interval_us)
+                        max_interval_us = us;
+                    if (warnings_logged < ISR_EVENT_LOG_LIMIT)
+                        ESP_LOGW(TAG_ISR, "Scan tick late: %lu us since the previous one", us);
+                    warnings_logged++;
+                    break;
+                case ISR_EVENT_SLOW:
+                    if (us > max_slow_us)
+                        max_slow_us = us;
+                    if (warnings_logged < ISR_EVENT_LOG_LIMIT)
+                        ESP_LOGW(TAG_ISR, "Scan ISR took %lu us", us);
+                    warnings_logged++;
+                    break;
+                case ISR_EVENT_BUTTON:
+                    ESP_LOGI(TAG_ISR, "Button on GPIO %d %s", event.arg, event.value ? "released" : "pressed");
+                    break;
+                case ISR_EVENT_FRAME_SWAP:
+                    ESP_LOGD(TAG_ISR, "Frame %d now showing", event.arg);
+                    break;
             }
         }
-        else
+        
+        uint32_t dropped = isr_event_ring_dropped(&isr_event_ring);
+        if (++summary_counter >= ISR_EVENT_SUMMARY_INTERVAL_MS / ISR_EVENT_DRAIN_INTERVAL_MS || dropped != dropped_reported)
         {
-            if (timeSet && wifi_connected && got_gas_unit_rate)
-            {
-                // Generate numeric digits
-                // Gas
-                get_display_digits(gas_unit_rate, &display_digits[16], &dp_temp);
-                
-                decimal_points |= dp_temp << 16;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[16] = wifi_connected ? 0xB : 0xA;
-                display_digits[17] = timeSet ? 0xB : 0xA;
-                display_digits[18] = got_gas_unit_rate ? 0xB : 0xA;
-            }
-            
-            if (timeSet && wifi_connected && got_elec_unit_rate)
-            {
-                // Electricity
-                get_display_digits(elec_unit_rate, &display_digits[19], &dp_temp);
-                
-                decimal_points |= dp_temp << 19;
-            }
-            else
-            {
-                // generate dashes pattern
-                display_digits[19] = wifi_connected ? 0xB : 0xA;
-                display_digits[20] = timeSet ? 0xB : 0xA;
-                display_digits[21] = got_elec_unit_rate ? 0xB : 0xA;
-            }
+            summary_counter = 0;
+            dropped_reported = dropped;
+            ESP_LOGI(TAG_ISR, "%lu %s, %lu %s, %lu %s, %lu %s, %lu dropped; longest tick %lu us, slowest ISR %lu us",
+                counts[0], isr_event_names[0], counts[1], isr_event_names[1], counts[2], isr_event_names[2],
+                counts[3], isr_event_names[3], dropped, max_interval_us, max_slow_us);
+            if (warnings_logged > ISR_EVENT_LOG_LIMIT)
+                ESP_LOGW(TAG_ISR, "%lu late tick and slow ISR warnings not logged", warnings_logged - ISR_EVENT_LOG_LIMIT);
+            warnings_logged = 0;
         }
-        
-        // Get required segment patterns
-        for (uint8_t i = 0; i < NUM_OF_ANODES * 2; i++)
+    }
+}
+
+/* Scanner backend: the timer ISR drives one anode at a time through the shift register.
+ * Frames are double buffered; the ISR swaps to the new frame at the start of a scan cycle.
+ */
+static display_frame_t scan_frames[2];
+static volatile uint8_t scan_front_frame = 0;
+static volatile bool scan_frame_pending = false;
+static volatile uint8_t scan_brightness = NUMBER_OF_BRIGHTNESS_SETTINGS - 1;
+// Anodes used by the display layout, in scan order
+static uint8_t scan_schedule[NUM_OF_ANODES];
+static uint8_t scan_schedule_length = 0;
+
+// Build the scan schedule from the layout table so only anodes with digits on them get a time slot
+void scanner_build_schedule(void)
+{
+    scan_schedule_length = scanner_schedule_from_layout(display_layout, NUM_OF_LOGICAL_DISPLAYS, scan_schedule);
+    ESP_LOGI(TAG, "Scanning %d of %d anodes", scan_schedule_length, NUM_OF_ANODES);
+}
+
+// Callback for Timer Interrupt - displays the next digit on the 7-segment display on each run
+static bool IRAM_ATTR timer_group_isr_callback(void *args)
+{
+    static scanner_state_t scan_state = { 0 };
+    static uint32_t last_entry_cycles = 0;
+    static uint8_t button_levels = 0xFF;
+    scanner_output_t out;
+    uint32_t entry_cycles = isr_cycle_count();
+    
+    // Report ticks that came late, e.g. because interrupts were held off
+    uint32_t interval_cycles = entry_cycles - last_entry_cycles;
+    if (last_entry_cycles && interval_cycles > (ISR_TICK_US * 3 / 2) * isr_cycles_per_us)
+    {
+        isr_event_put(ISR_EVENT_OVERRUN, 0, interval_cycles, entry_cycles);
+    }
+    last_entry_cycles = entry_cycles;
+    
+    // If first digit is about to be displayed, switch to the latest frame
+    if ((scan_state.position == 0) && (scan_state.dim_cycle == 0))
+    {
+        if (scan_frame_pending)
+        {
+            scan_front_frame ^= 1;
+            scan_frame_pending = false;
+            isr_event_put(ISR_EVENT_FRAME_SWAP, scan_front_frame, 0, entry_cycles);
+        }
+        // Poll the buttons once per scan cycle and report edges
+        static const DRAM_ATTR uint8_t button_pins[3] = { pin_BUTTON2, pin_BUTTON3, pin_BUTTON4 };
+        for (uint8_t i = 0; i < 3; i++)
         {
-            display_segments[i] = segment_patterns[display_digits[i]];
+            uint8_t level = gpio_ll_get_level(&GPIO, button_pins[i]);
+            if (level != ((button_levels >> i) & 1))
+            {
+                button_levels ^= (1 << i);
+                isr_event_put(ISR_EVENT_BUTTON, button_pins[i], level, entry_cycles);
+            }
         }
     }
+    // Work out this tick's outputs and move on; see display_encoding.h
+    scanner_tick(&scan_state, scan_schedule, scan_schedule_length, &scan_frames[scan_front_frame], scan_brightness, &out);
     
     // Turn off all digits
     // SPI code needed here
@@ -1305,13 +3686,13 @@ static bool IRAM_ATTR timer_group_isr_callback(void *args)
                        | ((uint32_t)1 << (pin_segGR - 32))
                        | ((uint32_t)1 << (pin_segDPR - 32));
     
-    if (dim_cycle_counter >= (NUMBER_OF_BRIGHTNESS_SETTINGS - 1 - display_brightness))
+    if (out.lit)
     {
         // Turn on required digit
         // SPI code needed here
-        for (uint8_t i = 0; i < NUM_OF_ANODES; i++)
+        for (int8_t bit = NUM_OF_ANODES - 1; bit >= 0; bit--)
         {
-            gpio_set_level(pin_SDAT, (NUM_OF_ANODES - 1 - current_disp_index) == i ? 0 : 1);
+            gpio_set_level(pin_SDAT, (out.anode_word >> bit) & 1);
             ets_delay_us(SR_DELAY_US);
             gpio_set_level(pin_SCK, 1);
             ets_delay_us(SR_DELAY_US);
@@ -1327,53 +3708,33 @@ static bool IRAM_ATTR timer_group_isr_callback(void *args)
         
         // Turn on required segments
         GPIO.out_w1tc =
-                             ((((display_segments[current_disp_index] & 0x01) >> 0)) << pin_segAL )
-                           | ((((display_segments[current_disp_index] & 0x02) >> 1)) << pin_segBL )
-                           | ((((display_segments[current_disp_index] & 0x04) >> 2)) << pin_segCL )
-                           | ((((display_segments[current_disp_index] & 0x08) >> 3)) << pin_segDL )
-                           | ((((display_segments[current_disp_index] & 0x10) >> 4)) << pin_segEL )
-                           | ((((display_segments[current_disp_index] & 0x20) >> 5)) << pin_segFL )
-                           | ((((display_segments[current_disp_index] & 0x40) >> 6)) << pin_segGL )
-                           | ((((decimal_points >> current_disp_index & 0x01) >> 0)) << pin_segDPL)
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x01) >> 0)) << pin_segAR )
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x02) >> 1)) << pin_segBR )
+                             (((out.segments[0] >> 0) & 1) << pin_segAL )
+                           | (((out.segments[0] >> 1) & 1) << pin_segBL )
+                           | (((out.segments[0] >> 2) & 1) << pin_segCL )
+                           | (((out.segments[0] >> 3) & 1) << pin_segDL )
+                           | (((out.segments[0] >> 4) & 1) << pin_segEL )
+                           | (((out.segments[0] >> 5) & 1) << pin_segFL )
+                           | (((out.segments[0] >> 6) & 1) << pin_segGL )
+                           | (((out.segments[0] >> 7) & 1) << pin_segDPL)
+                           | (((out.segments[1] >> 0) & 1) << pin_segAR )
+                           | (((out.segments[1] >> 1) & 1) << pin_segBR )
                            ;
         GPIO.out1_w1tc.val = 
-                             ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x04) >> 2)) << (pin_segCR - 32) )
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x08) >> 3)) << (pin_segDR - 32) )
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x10) >> 4)) << (pin_segER - 32) )
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x20) >> 5)) << (pin_segFR - 32) )
-                           | ((((display_segments[current_disp_index + NUM_OF_ANODES] & 0x40) >> 6)) << (pin_segGR - 32) )
-                           | ((((decimal_points >> (current_disp_index + NUM_OF_ANODES) & 0x01) >> 0)) << (pin_segDPR - 32) )
+                             (((out.segments[1] >> 2) & 1) << (pin_segCR - 32) )
+                           | (((out.segments[1] >> 3) & 1) << (pin_segDR - 32) )
+                           | (((out.segments[1] >> 4) & 1) << (pin_segER - 32) )
+                           | (((out.segments[1] >> 5) & 1) << (pin_segFR - 32) )
+                           | (((out.segments[1] >> 6) & 1) << (pin_segGR - 32) )
+                           | (((out.segments[1] >> 7) & 1) << (pin_segDPR - 32) )
                            ;
     }
     
-    // There are NUMBER_OF_BRIGHTNESS_SETTINGS iterations of dim_cycle_counter where the display is turned off or on
-    // according to the value of display_brightness to change the brightness of the digit. After all iterations,
-    // current_disp_index (the digit counter) is incremented. 
-    if (dim_cycle_counter < (NUMBER_OF_BRIGHTNESS_SETTINGS - 1))
-    {
-        dim_cycle_counter++;
-    }
-    else
+    uint32_t isr_cycles = isr_cycle_count() - entry_cycles;
+    if (isr_cycles > ISR_SLOW_US * isr_cycles_per_us)
     {
-        dim_cycle_counter = 0;
-        do
-        {
-            if (current_disp_index < NUM_OF_ANODES - 1)
-            {
-                current_disp_index++;
-            }
-            else
-            {
-                current_disp_index = 0;
-            }
-        }
-        while ((ANODES_IN_USE >> current_disp_index) == 0);
+        isr_event_put(ISR_EVENT_SLOW, 0, isr_cycles, entry_cycles);
     }
     
-    
-    
     return true; // return whether we need to yield at the end of ISR
 }
 
@@ -1398,36 +3759,150 @@ static void example_timer_init(int group, int timer, bool auto_reload, int timer
     }; // default clock source is APB
     timer_init(group, timer, &config);
 
-    /* Timer's counter will initially start from value below.
-       Also, if auto_reload is set, this value will be automatically reload on alarm */
-    timer_set_counter_value(group, timer, 0);
+    /* Timer's counter will initially start from value below.
+       Also, if auto_reload is set, this value will be automatically reload on alarm */
+    timer_set_counter_value(group, timer, 0);
+
+    /* Configure the alarm value and the interrupt on alarm. */
+    timer_set_alarm_value(group, timer, timer_interval_tenthmsec * TIMER_SCALE);
+    timer_enable_intr(group, timer);
+
+    timer_info_t *timer_info = calloc(1, sizeof(timer_info_t));
+    timer_info->timer_group = group;
+    timer_info->timer_idx = timer;
+    timer_info->auto_reload = auto_reload;
+    timer_info->alarm_interval = timer_interval_tenthmsec;
+    timer_isr_callback_add(group, timer, timer_group_isr_callback, timer_info, 0);
+
+    timer_start(group, timer);
+}
+
+// Configure timer here to guarantee that the ISR runs on the core display_task is pinned to
+void scanner_init(void)
+{
+    TaskHandle_t isrEventHandle;
+    
+    scanner_build_schedule();
+    isr_cycles_per_us = ets_get_cpu_frequency();
+    xTaskCreatePinnedToCore(isr_event_task, "isr_event_task", 3072, NULL, tskIDLE_PRIORITY + 1, &isrEventHandle, 0);
+    example_timer_init(TIMER_GROUP_0, TIMER_0, true, ISR_TICK_US / 100);
+}
+
+bool scanner_push_frame(const display_frame_t * frame)
+{
+    // The ISR hasn't picked up the previous frame yet
+    if (scan_frame_pending)
+        return false;
+    scan_frames[scan_front_frame ^ 1] = *frame;
+    scan_frame_pending = true;
+    return true;
+}
+
+void scanner_set_brightness(uint8_t brightness)
+{
+    scan_brightness = brightness;
+}
+
+/* MAX7219 backend: a daisy chain of MAX7219s in no-decode mode on the shift register pins
+ * (DIN = SDAT, CLK = SCK, LOAD = SLAT). The register writes are worked out in
+ * display_encoding.c; only the bit-banging is done here.
+ */
+static max7219_state_t max7219_state;
+
+// Shift one write down the chain, then latch it into every chip
+void max7219_write_chain(const max7219_chain_write_t * write)
+{
+    gpio_set_level(pin_SLAT, 0);
+    for (uint8_t i = 0; i < MAX7219_CHAIN_LENGTH; i++)
+    {
+        for (int8_t bit = 15; bit >= 0; bit--)
+        {
+            gpio_set_level(pin_SDAT, (write->words[i] >> bit) & 1);
+            ets_delay_us(SR_DELAY_US);
+            gpio_set_level(pin_SCK, 1);
+            ets_delay_us(SR_DELAY_US);
+            gpio_set_level(pin_SCK, 0);
+        }
+    }
+    ets_delay_us(SR_DELAY_US);
+    gpio_set_level(pin_SLAT, 1);
+    ets_delay_us(SR_DELAY_US);
+}
+
+void max7219_write_all(uint8_t reg, uint8_t value)
+{
+    max7219_chain_write_t write;
+    max7219_chain_all(&write, reg, value);
+    max7219_write_chain(&write);
+}
 
-    /* Configure the alarm value and the interrupt on alarm. */
-    timer_set_alarm_value(group, timer, timer_interval_tenthmsec * TIMER_SCALE);
-    timer_enable_intr(group, timer);
+void max7219_init(void)
+{
+    gpio_set_level(pin_SCK, 0);
+    max7219_write_all(MAX7219_REG_DISPLAY_TEST, 0);
+    max7219_write_all(MAX7219_REG_SCAN_LIMIT, 7);
+    max7219_write_all(MAX7219_REG_DECODE_MODE, 0);
+    max7219_write_all(MAX7219_REG_SHUTDOWN, 1);
+    max7219_state.valid = false;
+}
 
-    timer_info_t *timer_info = calloc(1, sizeof(timer_info_t));
-    timer_info->timer_group = group;
-    timer_info->timer_idx = timer;
-    timer_info->auto_reload = auto_reload;
-    timer_info->alarm_interval = timer_interval_tenthmsec;
-    timer_isr_callback_add(group, timer, timer_group_isr_callback, timer_info, 0);
+bool max7219_push_frame(const display_frame_t * frame)
+{
+    max7219_chain_write_t writes[8];
+    uint8_t count = max7219_encode_frame(&max7219_state, frame, writes);
+    
+    for (uint8_t i = 0; i < count; i++)
+        max7219_write_chain(&writes[i]);
+    return true;
+}
 
-    timer_start(group, timer);
+void max7219_set_brightness(uint8_t brightness)
+{
+    max7219_write_all(MAX7219_REG_INTENSITY, max7219_intensity(brightness));
 }
 
-// Display task - sets up the Timer Interrupt on whichever core display_task is pinned to
-// Timer interrupt used for updating the display to allow for faster refresh rate
+static const display_backend_t display_backends[] = {
+    [DISPLAY_BACKEND_SCANNER] = { "scanner", scanner_init, scanner_push_frame, scanner_set_brightness },
+    [DISPLAY_BACKEND_MAX7219] = { "MAX7219", max7219_init, max7219_push_frame, max7219_set_brightness },
+};
+
+// Display task - composes frames and passes them to the display backend when they change
+// The backend is initialised here so the scanner's timer ISR runs on whichever core display_task is pinned to
 void display_task(void * pvParameters)
 {
-    ESP_LOGI(TAG, "starting display_task on core %d", xPortGetCoreID());
+    const display_backend_t * backend = &display_backends[CONFIG_ESP_DISPLAY_BACKEND];
+    static display_frame_t frame;
+    static display_frame_t last_frame;
+    bool frame_pushed = false;
+    uint8_t brightness = NUMBER_OF_BRIGHTNESS_SETTINGS;
     
-    // Configure timer in this task to guarantee that correct core is used for ISR
-    example_timer_init(TIMER_GROUP_0, TIMER_0, true, 2);
+    ESP_LOGI(TAG, "starting display_task on core %d with %s backend", xPortGetCoreID(), backend->name);
+    
+    backend->init();
     
     while(1)
     {
-        vTaskDelay(10000 / portTICK_PERIOD_MS);
+        uint8_t drawn;
+        bool all_rates_shown = display_compose_frame(&frame, &drawn);
+        bool frame_current = frame_pushed && memcmp(&frame, &last_frame, sizeof(frame)) == 0;
+        if (!frame_current)
+        {
+            if (backend->push_frame(&frame))
+            {
+                last_frame = frame;
+                frame_pushed = true;
+                frame_current = true;
+            }
+        }
+        if (frame_current)
+            freshness_record_frame(drawn);
+        freshness_record_availability(all_rates_shown);
+        if (display_brightness != brightness)
+        {
+            brightness = display_brightness;
+            backend->set_brightness(brightness);
+        }
+        vTaskDelay(DISPLAY_COMPOSE_INTERVAL_MS / portTICK_PERIOD_MS);
     }
 }
 
@@ -1508,15 +3983,7 @@ void fetcher_watchdog_task(void * pvParameters)
         // Non-blocking one-second delay
         vTaskDelay(1000 / portTICK_PERIOD_MS);
         // Check if any enabled unit rates haven't been obtained for any reason.
-        // Tomorrow's rates don't need to be checked here as they are checked hourly elsewhere.
-        if
-        (
-            (!got_gas_unit_rate) ||
-            (!got_elec_unit_rate) ||
-            ((!got_gas_flex_unit_rate) && CONFIG_ESP_TARIFF_FLEX_ENABLE) ||
-            ((!got_elec_flex_unit_rate) && CONFIG_ESP_TARIFF_FLEX_ENABLE) ||
-            ((!got_elec_agile_unit_rate) && CONFIG_ESP_TARIFF_AGILE_ENABLE)
-        )
+        if (!got_all_enabled_unit_rates())
         {
             // Increment seconds counter and restart if limit is exceeded
             secondsCounter++;
@@ -1536,9 +4003,637 @@ void fetcher_watchdog_task(void * pvParameters)
     }
 }
 
+/* Remote syslog
+ *
+ * Log output is captured by a vprintf hook into a fixed ring of slots and shipped by a
+ * low priority task on core 0 as RFC 5424 messages over UDP, several to a datagram when
+ * batching is on. Producers never wait: each one takes a ticket with an atomic increment
+ * and claims the slot it maps to by moving the slot's sequence number from an earlier
+ * complete record to odd (being written) with a compare-and-swap. If the slot is still
+ * being written, or already holds a later record, the claim fails and the line is dropped
+ * rather than torn. The shipper copies a slot only when its sequence number matches the
+ * ticket it expects, and skips tickets that never complete, counting whatever it missed
+ * as dropped.
+ */
+static const char *TAG_SYSLOG = "SYSLOG";
+
+#define SYSLOG_RING_SLOTS 32    // Must be a power of two
+#define SYSLOG_LINE_MAX 160
+#define SYSLOG_MESSAGE_MAX (SYSLOG_LINE_MAX + 96)
+#define SYSLOG_DATAGRAM_MAX 1200    // Stays within one Ethernet frame
+#define SYSLOG_SHIP_INTERVAL_MS 500
+#define SYSLOG_STATS_INTERVAL_MS 60000
+#define SYSLOG_STALL_PASSES 2   // Passes to wait for a record still being written before skipping it
+#define SYSLOG_RESOLVE_BACKOFF_MAX_PASSES 120
+#define SYSLOG_FACILITY_LOCAL0 16
+
+typedef struct {
+    atomic_uint_fast32_t seq;   // 2 * ticket + 1 while writing, 2 * ticket + 2 when complete
+    time_t time;
+    uint16_t length;
+    char text[SYSLOG_LINE_MAX];
+} syslog_slot_t;
+
+static syslog_slot_t syslog_ring[SYSLOG_RING_SLOTS];
+static atomic_uint_fast32_t syslog_head = 0;
+static vprintf_like_t syslog_uart_vprintf = NULL;
+static uint32_t syslog_shipped = 0;
+static uint32_t syslog_datagrams = 0;
+static atomic_uint_fast32_t syslog_dropped = 0;
+static uint32_t syslog_send_errors = 0;
+
+int syslog_vprintf(const char * format, va_list args)
+{
+    int ret = 0;
+    
+    if (CONFIG_ESP_SYSLOG_UART_ECHO && syslog_uart_vprintf)
+    {
+        va_list uart_args;
+        va_copy(uart_args, args);
+        ret = syslog_uart_vprintf(format, uart_args);
+        va_end(uart_args);
+    }
+    
+    uint32_t ticket = atomic_fetch_add(&syslog_head, 1);
+    syslog_slot_t * slot = &syslog_ring[ticket & (SYSLOG_RING_SLOTS - 1)];
+    uint_fast32_t seq = atomic_load(&slot->seq);
+    // Only a complete record from an earlier lap may be overwritten
+    if ((seq & 1) || (int32_t)((uint32_t)seq - 2 * ticket) > 0
+        || !atomic_compare_exchange_strong(&slot->seq, &seq, 2 * ticket + 1))
+    {
+        atomic_fetch_add(&syslog_dropped, 1);
+        return CONFIG_ESP_SYSLOG_UART_ECHO ? ret : 0;
+    }
+    int n = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    slot->length = (n < 0) ? 0 : (n < sizeof(slot->text)) ? n : sizeof(slot->text) - 1;
+    slot->time = timeSet ? time(NULL) : 0;
+    uint_fast32_t writing = 2 * ticket + 1;
+    atomic_compare_exchange_strong(&slot->seq, &writing, 2 * ticket + 2);
+    
+    return CONFIG_ESP_SYSLOG_UART_ECHO ? ret : n;
+}
+
+// Map the ESP log level letter at the start of a line to a syslog severity
+uint8_t syslog_severity(const char * line)
+{
+    switch (line[0])
+    {
+        case 'E': return 3;
+        case 'W': return 4;
+        case 'I': return 6;
+        default: return 7;
+    }
+}
+
+// Copy a log line into dst without colour codes or trailing newlines and return its length
+size_t syslog_clean_line(char * dst, const char * src, size_t length)
+{
+    size_t out = 0;
+    
+    for (size_t i = 0; i < length; i++)
+    {
+        if (src[i] == '\033')
+        {
+            while (i < length && src[i] != 'm')
+                i++;
+            continue;
+        }
+        if (src[i] != '\n' && src[i] != '\r')
+            dst[out++] = src[i];
+    }
+    dst[out] = '\0';
+    return out;
+}
+
+// Format one record as an RFC 5424 message into message and return its length, 0 if empty
+size_t syslog_format_record(char * message, const syslog_slot_t * record)
+{
+    char line[SYSLOG_LINE_MAX];
+    char timestamp[24] = "-";
+    struct tm time_struct;
+    
+    size_t length = syslog_clean_line(line, record->text, record->length);
+    if (length == 0)
+        return 0;
+    if (record->time)
+    {
+        gmtime_r(&record->time, &time_struct);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &time_struct);
+    }
+    int n = snprintf(message, SYSLOG_MESSAGE_MAX, "<%d>1 %s octopus-display unit-rates - - - %s",
+        SYSLOG_FACILITY_LOCAL0 * 8 + syslog_severity(line), timestamp, line);
+    return n < SYSLOG_MESSAGE_MAX ? n : SYSLOG_MESSAGE_MAX - 1;
+}
+
+// Send the messages in datagram, count_in_it of them, as one datagram
+void syslog_send_datagram(int sock, const struct sockaddr * addr, socklen_t addr_len, const char * datagram, size_t length, uint32_t count_in_it)
+{
+    if (length == 0)
+        return;
+    if (sendto(sock, datagram, length, 0, addr, addr_len) < 0)
+    {
+        syslog_send_errors++;
+        atomic_fetch_add(&syslog_dropped, count_in_it);
+    }
+    else
+    {
+        syslog_shipped += count_in_it;
+        syslog_datagrams++;
+    }
+}
+
+void syslog_task(void * pvParameters)
+{
+    uint32_t tail = 0;
+    uint32_t stats_counter = 0;
+    uint32_t stalled_passes = 0;
+    uint32_t resolve_wait = 0;
+    uint32_t resolve_backoff = 1;
+    int sock = -1;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    syslog_slot_t record;
+    char message[SYSLOG_MESSAGE_MAX];
+    static char datagram[SYSLOG_DATAGRAM_MAX];
+    size_t datagram_length = 0;
+    uint32_t datagram_count = 0;
+    
+    while(1)
+    {
+        vTaskDelay(SYSLOG_SHIP_INTERVAL_MS / portTICK_PERIOD_MS);
+        
+        // Back off while the collector's name doesn't resolve
+        if (sock < 0 && wifi_connected && (resolve_wait == 0 || --resolve_wait == 0))
+        {
+            struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+            struct addrinfo * res = NULL;
+            char port[8];
+            snprintf(port, sizeof(port), "%d", CONFIG_ESP_SYSLOG_PORT);
+            if (getaddrinfo(CONFIG_ESP_SYSLOG_HOST, port, &hints, &res) == 0 && res)
+            {
+                memcpy(&addr, res->ai_addr, res->ai_addrlen);
+                addr_len = res->ai_addrlen;
+                sock = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+                freeaddrinfo(res);
+                resolve_backoff = 1;
+            }
+            else
+            {
+                resolve_wait = resolve_backoff;
+                if (resolve_backoff < SYSLOG_RESOLVE_BACKOFF_MAX_PASSES)
+                    resolve_backoff *= 2;
+            }
+        }
+        
+        // Ship everything complete since the last pass
+        uint32_t head = atomic_load(&syslog_head);
+        if (head - tail > SYSLOG_RING_SLOTS)
+        {
+            atomic_fetch_add(&syslog_dropped, head - tail - SYSLOG_RING_SLOTS);
+            tail = head - SYSLOG_RING_SLOTS;
+            stalled_passes = 0;
+        }
+        while (tail != head)
+        {
+            syslog_slot_t * slot = &syslog_ring[tail & (SYSLOG_RING_SLOTS - 1)];
+            uint32_t seq = atomic_load(&slot->seq);
+            if ((int32_t)(seq - (2 * tail + 2)) < 0)
+            {
+                // Still being written, or the producer couldn't claim the slot and the record
+                // will never arrive. Wait a pass or two before giving up on it.
+                if (++stalled_passes < SYSLOG_STALL_PASSES)
+                    break;
+                atomic_fetch_add(&syslog_dropped, 1);
+                stalled_passes = 0;
+                tail++;
+                continue;
+            }
+            stalled_passes = 0;
+            if (seq == 2 * tail + 2)
+            {
+                record.time = slot->time;
+                record.length = slot->length;
+                memcpy(record.text, slot->text, record.length);
+            }
+            // Overwritten by a later record before or while being copied
+            if (seq != 2 * tail + 2 || atomic_load(&slot->seq) != seq)
+            {
+                atomic_fetch_add(&syslog_dropped, 1);
+                tail++;
+                continue;
+            }
+            tail++;
+            if (sock < 0 || !wifi_connected)
+            {
+                atomic_fetch_add(&syslog_dropped, 1);
+                continue;
+            }
+            size_t length = syslog_format_record(message, &record);
+            if (length == 0)
+                continue;
+            if (!CONFIG_ESP_SYSLOG_BATCH)
+            {
+                syslog_send_datagram(sock, (struct sockaddr *)&addr, addr_len, message, length, 1);
+                continue;
+            }
+            // Messages in a datagram are separated by newlines
+            if (datagram_length && datagram_length + 1 + length > sizeof(datagram))
+            {
+                syslog_send_datagram(sock, (struct sockaddr *)&addr, addr_len, datagram, datagram_length, datagram_count);
+                datagram_length = 0;
+                datagram_count = 0;
+            }
+            if (datagram_length)
+                datagram[datagram_length++] = '\n';
+            memcpy(datagram + datagram_length, message, length);
+            datagram_length += length;
+            datagram_count++;
+        }
+        if (datagram_length)
+        {
+            syslog_send_datagram(sock, (struct sockaddr *)&addr, addr_len, datagram, datagram_length, datagram_count);
+            datagram_length = 0;
+            datagram_count = 0;
+        }
+        
+        if (++stats_counter >= SYSLOG_STATS_INTERVAL_MS / SYSLOG_SHIP_INTERVAL_MS)
+        {
+            stats_counter = 0;
+            ESP_LOGI(TAG_SYSLOG, "%lu shipped in %lu datagrams, %lu dropped, %lu send errors",
+                syslog_shipped, syslog_datagrams, (uint32_t)atomic_load(&syslog_dropped), syslog_send_errors);
+        }
+    }
+}
+
+// Capture log output from here on and start shipping it
+void syslog_start(void)
+{
+    TaskHandle_t syslogHandle;
+    
+    if (CONFIG_ESP_SYSLOG_HOST[0] == '\0')
+    {
+        ESP_LOGW(TAG_SYSLOG, "Remote syslog is enabled but no collector host is set, not starting");
+        return;
+    }
+    syslog_uart_vprintf = esp_log_set_vprintf(syslog_vprintf);
+    xTaskCreatePinnedToCore(syslog_task, "syslog_task", 4096, NULL, tskIDLE_PRIORITY + 1, &syslogHandle, 0);
+}
+
+/* Delta OTA updates from a LAN update server
+ *
+ * The device asks CONFIG_ESP_OTA_SERVER_URL for a delta from the build it is running
+ * (identified by its ELF SHA-256) to the server's latest build. A delta is a header
+ * followed by a list of operations that rebuild the new image:
+ *
+ *   'C' offset length      Copy length bytes from offset in the running partition
+ *   'I' length data...     Insert length bytes from the delta
+ *   'E'                    End
+ *
+ * All integers are 32-bit little endian. The header gives the size and SHA-256 of the image
+ * the delta was made against, which is checked against the running partition before
+ * anything is written, and of the new image, which is checked once it has been written.
+ * The new image is written to the inactive OTA slot as the delta streams in.
+ *
+ * The header also carries an ECDSA P-256 signature of the new image's SHA-256, which must
+ * verify against the public key built into the firmware before anything is written. As the
+ * image is only booted if it matches that hash, nothing the server didn't sign is installed,
+ * even though updates come over plain HTTP. With CONFIG_ESP_OTA_FULL_IMAGE the device asks
+ * for the whole image instead; the server sends it as an update against an empty image,
+ * made of inserts only.
+ *
+ * If the bootloader has rollback enabled, a new image starts out pending verification.
+ * It is marked valid once it has connected to Wi-Fi and got the time; if that doesn't
+ * happen in time the previous image is restored, as it is by the bootloader if the new
+ * image crashes or resets before then. Missing prices don't count against the image, as
+ * an outage of the Octopus API would otherwise roll back every update.
+ *
+ * ota_server.py in the project root makes deltas and serves them.
+ */
+static const char *TAG_OTA = "OTA";
+
+#define OTA_DELTA_MAGIC "OUD2"
+#define OTA_MAX_SIGNATURE 72
+#define OTA_BUFFER_SIZE 1024
+#define OTA_HEALTH_CHECK_TIMEOUT_S (10 * 60)
+#define OTA_HTTP_TIMEOUT_MS 10000
+
+#define OTA_OP_COPY 'C'
+#define OTA_OP_INSERT 'I'
+#define OTA_OP_END 'E'
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint32_t source_size;
+    uint8_t source_sha256[32];
+    uint32_t target_size;
+    uint8_t target_sha256[32];
+    uint32_t signature_length;
+    uint8_t signature[OTA_MAX_SIGNATURE];  // DER encoded ECDSA P-256 signature of target_sha256
+} ota_delta_header_t;
+
+static uint8_t ota_buffer[OTA_BUFFER_SIZE];
+
+// Read exactly len bytes of the response. Returns false if the connection ends first.
+bool ota_read_exact(esp_http_client_handle_t client, void * buf, size_t len, uint32_t * bytes_received)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        int ret = esp_http_client_read(client, (char *)buf + done, len - done);
+        if (ret <= 0)
+            return false;
+        done += ret;
+    }
+    *bytes_received += len;
+    return true;
+}
+
+uint32_t ota_read_u32(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Check that the new image's hash is signed by the key built into the firmware
+bool ota_check_signature(const ota_delta_header_t * header)
+{
+    mbedtls_pk_context pk;
+    bool ok = false;
+    
+    if (header->signature_length > OTA_MAX_SIGNATURE)
+        return false;
+    mbedtls_pk_init(&pk);
+    if (mbedtls_pk_parse_public_key(&pk, (const unsigned char *)ota_public_key_pem_start, ota_public_key_pem_end - ota_public_key_pem_start) != 0)
+        ESP_LOGE(TAG_OTA, "Can't parse the built-in public key");
+    else
+        ok = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, header->target_sha256, sizeof(header->target_sha256),
+            header->signature, header->signature_length) == 0;
+    mbedtls_pk_free(&pk);
+    return ok;
+}
+
+// Check that the first size bytes of the running partition are what the delta was made against
+bool ota_check_source(const esp_partition_t * running, uint32_t size, const uint8_t * expected_sha256)
+{
+    mbedtls_sha256_context sha;
+    uint8_t digest[32];
+    
+    if (size > running->size)
+        return false;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    for (uint32_t offset = 0; offset < size; offset += OTA_BUFFER_SIZE)
+    {
+        uint32_t n = (size - offset < OTA_BUFFER_SIZE) ? size - offset : OTA_BUFFER_SIZE;
+        if (esp_partition_read(running, offset, ota_buffer, n) != ESP_OK)
+        {
+            mbedtls_sha256_free(&sha);
+            return false;
+        }
+        mbedtls_sha256_update(&sha, ota_buffer, n);
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return memcmp(digest, expected_sha256, sizeof(digest)) == 0;
+}
+
+// Write to the new image, keeping track of its hash and size
+bool ota_write(esp_ota_handle_t handle, mbedtls_sha256_context * sha, const uint8_t * data, size_t len, uint32_t * written, uint32_t target_size)
+{
+    if (*written + len > target_size)
+    {
+        ESP_LOGE(TAG_OTA, "Delta writes past the end of the %lu byte image", target_size);
+        return false;
+    }
+    mbedtls_sha256_update(sha, data, len);
+    if (esp_ota_write(handle, data, len) != ESP_OK)
+        return false;
+    *written += len;
+    return true;
+}
+
+// Apply the delta operations from the response to the update partition
+bool ota_apply_delta(esp_http_client_handle_t client, const esp_partition_t * running, esp_ota_handle_t handle,
+    const ota_delta_header_t * header, uint32_t * bytes_received, uint32_t * copied)
+{
+    mbedtls_sha256_context sha;
+    uint8_t digest[32];
+    uint8_t op[9];
+    uint32_t written = 0;
+    bool ok = false;
+    
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    while (ota_read_exact(client, op, 1, bytes_received))
+    {
+        if (op[0] == OTA_OP_END)
+        {
+            mbedtls_sha256_finish(&sha, digest);
+            if (written != header->target_size)
+                ESP_LOGE(TAG_OTA, "Delta made %lu bytes, expected %lu", written, header->target_size);
+            else if (memcmp(digest, header->target_sha256, sizeof(digest)) != 0)
+                ESP_LOGE(TAG_OTA, "New image hash doesn't match");
+            else
+                ok = true;
+            break;
+        }
+        else if (op[0] == OTA_OP_COPY)
+        {
+            if (!ota_read_exact(client, op + 1, 8, bytes_received))
+                break;
+            uint32_t offset = ota_read_u32(op + 1);
+            uint32_t length = ota_read_u32(op + 5);
+            if (offset + length < offset || offset + length > header->source_size)
+            {
+                ESP_LOGE(TAG_OTA, "Copy of %lu bytes from %lu is outside the running image", length, offset);
+                break;
+            }
+            while (length)
+            {
+                uint32_t n = (length < OTA_BUFFER_SIZE) ? length : OTA_BUFFER_SIZE;
+                if (esp_partition_read(running, offset, ota_buffer, n) != ESP_OK
+                    || !ota_write(handle, &sha, ota_buffer, n, &written, header->target_size))
+                    break;
+                offset += n;
+                length -= n;
+                *copied += n;
+            }
+            if (length)
+                break;
+        }
+        else if (op[0] == OTA_OP_INSERT)
+        {
+            if (!ota_read_exact(client, op + 1, 4, bytes_received))
+                break;
+            uint32_t length = ota_read_u32(op + 1);
+            while (length)
+            {
+                uint32_t n = (length < OTA_BUFFER_SIZE) ? length : OTA_BUFFER_SIZE;
+                if (!ota_read_exact(client, ota_buffer, n, bytes_received)
+                    || !ota_write(handle, &sha, ota_buffer, n, &written, header->target_size))
+                    break;
+                length -= n;
+            }
+            if (length)
+                break;
+        }
+        else
+        {
+            ESP_LOGE(TAG_OTA, "Unknown delta operation 0x%02X", op[0]);
+            break;
+        }
+    }
+    mbedtls_sha256_free(&sha);
+    return ok;
+}
+
+// Ask the update server for a delta to its latest build and install it. Only returns if there is no update.
+void ota_check_for_update(void)
+{
+    const esp_partition_t * running = esp_ota_get_running_partition();
+    const esp_partition_t * update = esp_ota_get_next_update_partition(NULL);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    const esp_app_desc_t * app = esp_app_get_description();
+#else
+    const esp_app_desc_t * app = esp_ota_get_app_description();
+#endif
+    char url[255];
+    ota_delta_header_t header = { 0 };
+    esp_ota_handle_t handle = 0;
+    uint32_t bytes_received = 0;
+    uint32_t copied = 0;
+    int64_t start_us = esp_timer_get_time();
+    
+    if (update == NULL)
+    {
+        ESP_LOGE(TAG_OTA, "No OTA partition to update into, check the partition table");
+        return;
+    }
+    int len = snprintf(url, sizeof(url), "%s/delta?project=%s&full=%d&from=", CONFIG_ESP_OTA_SERVER_URL, app->project_name, CONFIG_ESP_OTA_FULL_IMAGE);
+    for (uint8_t i = 0; i < sizeof(app->app_elf_sha256) && len < sizeof(url) - 3; i++)
+        len += snprintf(url + len, sizeof(url) - len, "%02x", app->app_elf_sha256[i]);
+    
+    esp_http_client_config_t config = {
+        .url = url,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (esp_http_client_open(client, 0) != ESP_OK)
+    {
+        ESP_LOGW(TAG_OTA, "Can't connect to update server");
+        esp_http_client_cleanup(client);
+        return;
+    }
+    esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (status != 200)
+    {
+        // 204: already up to date, 404: the server has no delta from this build
+        ESP_LOGI(TAG_OTA, "No update (status %d) for version %s", status, app->version);
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        return;
+    }
+    
+    bool ok = false;
+    if (!ota_read_exact(client, &header, sizeof(header), &bytes_received) || memcmp(header.magic, OTA_DELTA_MAGIC, 4) != 0)
+    {
+        ESP_LOGE(TAG_OTA, "Not a delta");
+    }
+    else if (!ota_check_signature(&header))
+    {
+        ESP_LOGE(TAG_OTA, "Update isn't signed with the built-in key");
+    }
+    else if (header.target_size > update->size)
+    {
+        ESP_LOGE(TAG_OTA, "New image of %lu bytes doesn't fit in %s", header.target_size, update->label);
+    }
+    else if (!ota_check_source(running, header.source_size, header.source_sha256))
+    {
+        ESP_LOGE(TAG_OTA, "Delta wasn't made against the running image");
+    }
+    else if (esp_ota_begin(update, header.target_size, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG_OTA, "Can't start writing to %s", update->label);
+    }
+    else
+    {
+        ESP_LOGI(TAG_OTA, "Applying delta to %s: %lu byte image", update->label, header.target_size);
+        if (ota_apply_delta(client, running, handle, &header, &bytes_received, &copied))
+        {
+            ok = (esp_ota_end(handle) == ESP_OK) && (esp_ota_set_boot_partition(update) == ESP_OK);
+            if (!ok)
+                ESP_LOGE(TAG_OTA, "New image failed validation");
+        }
+        else
+        {
+            esp_ota_abort(handle);
+        }
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    
+    int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    ESP_LOGI(TAG_OTA, "%s after %lld ms: received %lu bytes for a %lu byte image (%lu%% of a full image download), %lu bytes copied from the running image",
+        ok ? "Update installed" : "Update failed", elapsed_ms, bytes_received, header.target_size,
+        header.target_size ? (uint32_t)((uint64_t)bytes_received * 100 / header.target_size) : 0, copied);
+    if (ok)
+    {
+        ESP_LOGI(TAG_OTA, "Restarting into the new image");
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+}
+
+// Keep a newly installed image once it has Wi-Fi and the time, otherwise roll back
+void ota_health_check(void)
+{
+    const esp_partition_t * running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)
+        return;
+    ESP_LOGI(TAG_OTA, "New image pending verification");
+    for (uint32_t seconds = 0; seconds < OTA_HEALTH_CHECK_TIMEOUT_S; seconds++)
+    {
+        if (get_health_state() >= HEALTH_NO_PRICES)
+        {
+            ESP_LOGI(TAG_OTA, "Health check passed after %lu s, keeping new image", seconds);
+            esp_ota_mark_app_valid_cancel_rollback();
+            return;
+        }
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+    ESP_LOGE(TAG_OTA, "Health check failed, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+void ota_task(void * pvParameters)
+{
+    ota_health_check();
+    
+    while(1)
+    {
+        if (wifi_connected)
+            ota_check_for_update();
+        vTaskDelay((CONFIG_ESP_OTA_CHECK_INTERVAL_MINUTES * 60 * 1000) / portTICK_PERIOD_MS);
+    }
+}
+
 // Main function - execution starts here
 void app_main()
 {
+    // Created before any task that might start the web server or publish the status
+    if (CONFIG_ESP_WEB_SERVER_ENABLE)
+    {
+        status_mutex = xSemaphoreCreateMutex();
+        sse_fanout_init(&sse_fanout, sse_clients, CONFIG_ESP_SSE_MAX_CLIENTS, sse_send, sse_drop, NULL);
+    }
+    
+    if (CONFIG_ESP_SYSLOG_ENABLE)
+    {
+        syslog_start();
+    }
+    
     ESP_LOGI("Reset reason: ", "%d", esp_reset_reason());
 	//Initialize NVS
 	esp_err_t ret = nvs_flash_init();
@@ -1610,17 +4705,29 @@ void app_main()
     TaskHandle_t displayHandle;
     TaskHandle_t getLightLevelHandle;
     TaskHandle_t fetcherWatchdogHandle;
+    TaskHandle_t statusPublisherHandle;
+    TaskHandle_t otaHandle;
     
     xTaskCreatePinnedToCore(get_unit_rates_task, "get_unit_rates_task", 8192, NULL, configMAX_PRIORITIES - 3, &getUnitRatesHandle, 1);
     
     // Uncomment this task and comment out display_task below to test display with different values
     //xTaskCreatePinnedToCore(test_task, "test_task", 4096, NULL, configMAX_PRIORITIES - 3, &getUnitRatesHandle, 1);
     
-    xTaskCreatePinnedToCore(display_task, "display_task", 2048, NULL, configMAX_PRIORITIES - 2, &displayHandle, 1);
+    xTaskCreatePinnedToCore(display_task, "display_task", 3072, NULL, configMAX_PRIORITIES - 2, &displayHandle, 1);
     
     xTaskCreatePinnedToCore(fetcher_watchdog_task, "fetcher_watchdog_task", 4096, NULL, configMAX_PRIORITIES - 1, &fetcherWatchdogHandle, 1);
     
     xTaskCreatePinnedToCore(get_light_level_task, "get_light_level_task", 4096, NULL, configMAX_PRIORITIES - 4, &getLightLevelHandle, 1);
+    
+    if (CONFIG_ESP_WEB_SERVER_ENABLE)
+    {
+        xTaskCreatePinnedToCore(status_publisher_task, "status_publisher_task", 4096, NULL, tskIDLE_PRIORITY + 1, &statusPublisherHandle, 0);
+    }
+    
+    if (CONFIG_ESP_OTA_ENABLE)
+    {
+        xTaskCreatePinnedToCore(ota_task, "ota_task", 6144, NULL, tskIDLE_PRIORITY + 1, &otaHandle, 0);
+    }
 
 	while(1)
     {
@@ -0,0 +1,95 @@
+/* Slot series - see slot_series.h
+ *
+ * Copyright (c) 2023 Nick Schollar
+ * Licenced under MIT Licence
+ */
+#include <string.h>
+#include "slot_series.h"
+
+const slot_series_format_t agile_series_format = { "results", "valid_from", "value_inc_vat", NULL };
+const slot_series_format_t carbon_intensity_series_format = { "data", "from", "intensity", "forecast" };
+
+bool parse_slot_series(const cJSON * root, const slot_series_format_t * format, const char * date_string, double * values, uint64_t * validity)
+{
+    uint8_t hour;
+
+    *validity = 0;
+    cJSON *item = cJSON_GetObjectItem(root, format->array_key);
+    if (item == NULL)
+        return false;
+    for (int i = 0 ; i < cJSON_GetArraySize(item) ; i++)
+    {
+        cJSON * subitem = cJSON_GetArrayItem(item, i);
+        cJSON * json_date = cJSON_GetObjectItem(subitem, format->from_key);
+        cJSON * value = cJSON_GetObjectItem(subitem, format->value_key);
+        if (format->value_subkey)
+            value = cJSON_GetObjectItem(value, format->value_subkey);
+        if (!cJSON_IsString(json_date) || !cJSON_IsNumber(value) || strlen(json_date->valuestring) < 16)
+            continue;
+
+        // Check that the date part matches today's date, by comparing first 10 characters
+        // with today's date string, because yesterday/tomorrow could be there as well
+        if (strncmp(json_date->valuestring, date_string, 10) == 0)
+        {
+            // Get hour for current entry from the from string
+            hour = (json_date->valuestring[11] - 48 ) * 10 + (json_date->valuestring[12] - 48);
+            if (hour <= 23)
+            {
+                if (json_date->valuestring[14] == '0')
+                {
+                    values[hour * 2] = value->valuedouble;
+                    *validity |= ((uint64_t)1 << (hour * 2));
+                }
+                else if (json_date->valuestring[14] == '3')
+                {
+                    values[hour * 2 + 1] = value->valuedouble;
+                    *validity |= ((uint64_t)1 << (hour * 2 + 1));
+                }
+            }
+        }
+    }
+    return true;
+}
+
+uint8_t best_window_find(const double * prices, const double * intensities, uint64_t usable, uint8_t first_slot, uint8_t length)
+{
+    double price_min = 0.0, price_max = 0.0, intensity_min = 0.0, intensity_max = 0.0;
+    bool any = false;
+    uint8_t best = BEST_WINDOW_NONE;
+    double best_score = 0.0;
+
+    if (length == 0)
+        return BEST_WINDOW_NONE;
+    for (uint8_t slot = first_slot; slot < SLOTS_PER_DAY; slot++)
+    {
+        if (!((usable >> slot) & 1))
+            continue;
+        if (!any || prices[slot] < price_min) price_min = prices[slot];
+        if (!any || prices[slot] > price_max) price_max = prices[slot];
+        if (!any || intensities[slot] < intensity_min) intensity_min = intensities[slot];
+        if (!any || intensities[slot] > intensity_max) intensity_max = intensities[slot];
+        any = true;
+    }
+    // A flat series scores zero everywhere rather than dividing by zero
+    double price_range = (price_max > price_min) ? price_max - price_min : 1.0;
+    double intensity_range = (intensity_max > intensity_min) ? intensity_max - intensity_min : 1.0;
+
+    for (uint8_t start = first_slot; any && start + length <= SLOTS_PER_DAY; start++)
+    {
+        uint64_t window_mask = (((uint64_t)1 << length) - 1) << start;
+        if ((usable & window_mask) != window_mask)
+            continue;
+        double score = 0.0;
+        for (uint8_t slot = start; slot < start + length; slot++)
+        {
+            score += (prices[slot] - price_min) / price_range
+                   + (intensities[slot] - intensity_min) / intensity_range;
+        }
+        if (best == BEST_WINDOW_NONE || score < best_score)
+        {
+            best = start;
+            best_score = score;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,45 @@
+/* Slot series
+ *
+ * Sources that give a value for each half-hour slot of the day (Agile prices, carbon intensity
+ * forecasts) are parsed the same way into an array of 48 values and a validity bitmap.
+ * Each source only differs in where its entries and values are found. Also the search for
+ * the cheapest and greenest window over the two series. No ESP-IDF dependencies apart from
+ * cJSON, so both can be checked on the host (see host_test).
+ */
+#ifndef SLOT_SERIES_H
+#define SLOT_SERIES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cJSON.h"
+
+#define SLOTS_PER_DAY 48
+#define BEST_WINDOW_NONE 0xFF
+
+typedef struct {
+    const char * array_key;         // Array of entries in the root object
+    const char * from_key;          // Start of the slot, YYYY-MM-DDTHH:MM...
+    const char * value_key;
+    const char * value_subkey;      // Key within value_key's object, NULL if value_key holds the number
+} slot_series_format_t;
+
+extern const slot_series_format_t agile_series_format;
+extern const slot_series_format_t carbon_intensity_series_format;
+
+// Put the values for the date in date_string (YYYY-MM-DD) into the slot array
+// 00:00 values[0]
+// 00:30 values[1]
+// 01:00 values[2]
+// and so on, setting a bit in validity for each slot found.
+// Returns false if root has no array of entries.
+bool parse_slot_series(const cJSON * root, const slot_series_format_t * format, const char * date_string, double * values, uint64_t * validity);
+
+/* Find the cheapest and greenest window of length slots from first_slot to the end of the
+ * day. Price and carbon intensity are each scaled to 0..1 over the remaining slots so that
+ * neither dominates, and the window with the lowest total wins, the earliest on a tie.
+ * Only slots set in usable are considered. Returns the first slot of the window, or
+ * BEST_WINDOW_NONE if there is no complete window left.
+ */
+uint8_t best_window_find(const double * prices, const double * intensities, uint64_t usable, uint8_t first_slot, uint8_t length);
+
+#endif
@@ -0,0 +1,61 @@
+/* SSE fan-out - see sse_fanout.h
+ *
+ * Copyright (c) 2023 Nick Schollar
+ * Licenced under MIT Licence
+ */
+#include "sse_fanout.h"
+
+void sse_fanout_init(sse_fanout_t * fanout, int * clients, uint8_t capacity, sse_send_fn send, sse_drop_fn drop, void * ctx)
+{
+    fanout->clients = clients;
+    fanout->capacity = capacity;
+    fanout->count = 0;
+    fanout->events_sent = 0;
+    fanout->send = send;
+    fanout->drop = drop;
+    fanout->ctx = ctx;
+}
+
+bool sse_fanout_add(sse_fanout_t * fanout, int fd)
+{
+    if (fanout->count >= fanout->capacity)
+        return false;
+    fanout->clients[fanout->count++] = fd;
+    return true;
+}
+
+bool sse_fanout_remove(sse_fanout_t * fanout, int fd)
+{
+    for (uint8_t i = 0; i < fanout->count; i++)
+    {
+        if (fanout->clients[i] == fd)
+        {
+            fanout->clients[i] = fanout->clients[--fanout->count];
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t sse_fanout_broadcast(sse_fanout_t * fanout, const char * data, size_t length, bool is_event)
+{
+    uint8_t dropped = 0;
+
+    for (uint8_t i = 0; i < fanout->count; )
+    {
+        int fd = fanout->clients[i];
+        if (fanout->send(fanout->ctx, fd, data, length) < 0)
+        {
+            // The last subscriber moves into this slot, so don't advance
+            fanout->clients[i] = fanout->clients[--fanout->count];
+            dropped++;
+            if (fanout->drop)
+                fanout->drop(fanout->ctx, fd);
+            continue;
+        }
+        if (is_event)
+            fanout->events_sent++;
+        i++;
+    }
+    return dropped;
+}
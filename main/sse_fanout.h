@@ -0,0 +1,42 @@
+/* SSE fan-out
+ *
+ * The list of sockets subscribed to /events and the broadcast of one already-serialized
+ * frame to all of them. Sending and closing go through callbacks, so this has no ESP-IDF
+ * dependencies and can be load tested on the host (see host_test). Not thread-safe: the
+ * caller holds its own lock around every call.
+ */
+#ifndef SSE_FANOUT_H
+#define SSE_FANOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Send length bytes to fd. Returns a negative value if the subscriber has gone away.
+typedef int (*sse_send_fn)(void * ctx, int fd, const char * data, size_t length);
+// Called after a subscriber has been dropped because a send to it failed
+typedef void (*sse_drop_fn)(void * ctx, int fd);
+
+typedef struct {
+    int * clients;
+    uint8_t capacity;
+    uint8_t count;
+    uint32_t events_sent;       // Frames successfully sent, counted per subscriber
+    sse_send_fn send;
+    sse_drop_fn drop;
+    void * ctx;
+} sse_fanout_t;
+
+void sse_fanout_init(sse_fanout_t * fanout, int * clients, uint8_t capacity, sse_send_fn send, sse_drop_fn drop, void * ctx);
+
+// Returns false if there is no room for another subscriber
+bool sse_fanout_add(sse_fanout_t * fanout, int fd);
+
+// Returns false if fd wasn't subscribed
+bool sse_fanout_remove(sse_fanout_t * fanout, int fd);
+
+// Send the same frame to every subscriber, dropping any that fail. Events are counted in
+// events_sent; keep-alives are not. Returns the number of subscribers dropped.
+uint8_t sse_fanout_broadcast(sse_fanout_t * fanout, const char * data, size_t length, bool is_event);
+
+#endif
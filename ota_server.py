@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+#
+# Delta OTA update server for the Octopus unit rate display
+#
+# Serves deltas between firmware builds in the format applied by ota_check_for_update()
+# in main/main.c. Keep every build that is running on a device in the firmware directory;
+# the newest .bin is offered as the update.
+#
+# Every update is signed with an ECDSA P-256 key and devices only install updates signed
+# by the key whose public half was built into them. keygen writes the private key and
+# main/ota_public_key.pem; keep the private key off the device and out of git.
+#
+#   ./ota_server.py keygen [--key ota_signing_key.pem]
+#   ./ota_server.py serve <firmware dir> [--port 8070] [--key ota_signing_key.pem]
+#   ./ota_server.py delta <old.bin> <new.bin> <out.delta> [--key ota_signing_key.pem]
+#
+# Signing uses the openssl command line tool.
+
+import argparse
+import hashlib
+import http.server
+import os
+import struct
+import subprocess
+import sys
+import urllib.parse
+
+MAGIC = b"OUD2"
+BLOCK = 64              # Smallest run copied from the old image
+MAX_INSERT = 1 << 20
+MAX_SIGNATURE = 72      # Largest DER encoded ECDSA P-256 signature
+HEADER_SIZE = 4 + 4 + 32 + 4 + 32 + 4 + MAX_SIGNATURE
+DEFAULT_KEY = "ota_signing_key.pem"
+PUBLIC_KEY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "main", "ota_public_key.pem")
+
+# Offset of app_elf_sha256 in an app image: image header (24) + segment header (8) + esp_app_desc_t fields before it (144)
+ELF_SHA256_OFFSET = 24 + 8 + 144
+PROJECT_NAME_OFFSET = 24 + 8 + 48
+
+
+def elf_sha256(image):
+    return image[ELF_SHA256_OFFSET:ELF_SHA256_OFFSET + 32].hex()
+
+
+def project_name(image):
+    return image[PROJECT_NAME_OFFSET:PROJECT_NAME_OFFSET + 32].split(b"\0")[0].decode(errors="replace")
+
+
+def sign_digest(digest, key):
+    """Return the DER encoded ECDSA signature of a SHA-256 digest with the private key file key."""
+    return subprocess.run(["openssl", "pkeyutl", "-sign", "-inkey", key], input=digest,
+                          stdout=subprocess.PIPE, check=True).stdout
+
+
+def verify_digest(digest, signature, public_key):
+    """Check a signature made by sign_digest against the public key file public_key."""
+    # pkeyutl only reads the signature from a file
+    sig_path = "%s.%d.sig" % (public_key, os.getpid())
+    with open(sig_path, "wb") as f:
+        f.write(signature)
+    try:
+        result = subprocess.run(["openssl", "pkeyutl", "-verify", "-pubin", "-inkey", public_key, "-sigfile", sig_path],
+                                input=digest, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    finally:
+        os.remove(sig_path)
+    return result.returncode == 0
+
+
+def keygen(args):
+    if os.path.exists(args.key):
+        sys.exit("%s already exists; devices built with its public key would no longer accept updates" % args.key)
+    subprocess.run(["openssl", "ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", args.key], check=True)
+    os.chmod(args.key, 0o600)
+    subprocess.run(["openssl", "ec", "-in", args.key, "-pubout", "-out", args.public_key], check=True)
+    print("Private key in %s, public key in %s" % (args.key, args.public_key))
+
+
+def make_header(old, new, key):
+    """Return the delta header, with the new image's hash signed by key."""
+    target_sha256 = hashlib.sha256(new).digest()
+    signature = sign_digest(target_sha256, key)
+    assert len(signature) <= MAX_SIGNATURE
+    return MAGIC + struct.pack("<I", len(old)) + hashlib.sha256(old).digest() \
+        + struct.pack("<I", len(new)) + target_sha256 \
+        + struct.pack("<I", len(signature)) + signature.ljust(MAX_SIGNATURE, b"\0")
+
+
+def insert_ops(data):
+    return [b"I" + struct.pack("<I", len(data[start:start + MAX_INSERT])) + data[start:start + MAX_INSERT]
+            for start in range(0, len(data), MAX_INSERT)]
+
+
+def make_full(new, key):
+    """Return an update that carries the whole of new, for devices that ask for a full image."""
+    return make_header(b"", new, key) + b"".join(insert_ops(new)) + b"E"
+
+
+def make_delta(old, new, key):
+    """Return a delta that rebuilds new from old using copies of matching runs and inserts."""
+    index = {}
+    for offset in range(0, len(old) - BLOCK + 1, BLOCK):
+        index.setdefault(old[offset:offset + BLOCK], offset)
+
+    ops = []
+    literal = bytearray()
+
+    def flush_literal():
+        ops.extend(insert_ops(bytes(literal)))
+        literal.clear()
+
+    pos = 0
+    while pos < len(new):
+        match = index.get(new[pos:pos + BLOCK]) if pos + BLOCK <= len(new) else None
+        if match is None:
+            literal.append(new[pos])
+            pos += 1
+            continue
+        # Extend the match backwards into pending literal bytes, then forwards
+        while literal and match > 0 and old[match - 1] == literal[-1]:
+            literal.pop()
+            match -= 1
+            pos -= 1
+        length = BLOCK
+        while pos + length < len(new) and match + length < len(old) and new[pos + length] == old[match + length]:
+            length += 1
+        flush_literal()
+        ops.append(b"C" + struct.pack("<II", match, length))
+        pos += length
+    flush_literal()
+    ops.append(b"E")
+    return make_header(old, new, key) + b"".join(ops)
+
+
+def apply_delta(old, delta, public_key=None):
+    """Rebuild the new image from old and delta, as the device does. Used to check deltas.
+    Raises ValueError if the delta is malformed, wasn't made against old or, when a public
+    key file is given, isn't signed by its private key."""
+    if len(delta) < HEADER_SIZE or delta[:4] != MAGIC:
+        raise ValueError("not a delta")
+    source_size, = struct.unpack_from("<I", delta, 4)
+    target_size, = struct.unpack_from("<I", delta, 40)
+    target_sha256 = delta[44:76]
+    signature_length, = struct.unpack_from("<I", delta, 76)
+    if signature_length > MAX_SIGNATURE:
+        raise ValueError("signature too long")
+    if public_key and not verify_digest(target_sha256, delta[80:80 + signature_length], public_key):
+        raise ValueError("bad signature")
+    if source_size > len(old) or hashlib.sha256(old[:source_size]).digest() != delta[8:40]:
+        raise ValueError("delta wasn't made against this image")
+    out = bytearray()
+    pos = HEADER_SIZE
+    while True:
+        op = delta[pos:pos + 1]
+        pos += 1
+        if op == b"C":
+            if pos + 8 > len(delta):
+                raise ValueError("truncated copy")
+            offset, length = struct.unpack_from("<II", delta, pos)
+            pos += 8
+            if offset + length > source_size:
+                raise ValueError("copy of %d bytes from %d is outside the old image" % (length, offset))
+            out += old[offset:offset + length]
+        elif op == b"I":
+            if pos + 4 > len(delta):
+                raise ValueError("truncated insert")
+            length, = struct.unpack_from("<I", delta, pos)
+            pos += 4
+            if pos + length > len(delta):
+                raise ValueError("truncated insert")
+            out += delta[pos:pos + length]
+            pos += length
+        elif op == b"E":
+            break
+        else:
+            raise ValueError("bad op %r" % op)
+        if len(out) > target_size:
+            raise ValueError("delta writes past the end of the new image")
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_sha256:
+        raise ValueError("new image doesn't match its hash")
+    return bytes(out)
+
+
+class Firmware:
+    def __init__(self, directory, key):
+        self.directory = directory
+        self.key = key
+        self.deltas = {}
+
+    def images(self):
+        paths = [os.path.join(self.directory, name) for name in os.listdir(self.directory) if name.endswith(".bin")]
+        paths.sort(key=os.path.getmtime)
+        return paths
+
+    def delta_from(self, project, from_sha, full=False):
+        """Return (status, body) for a device running the build with ELF SHA-256 from_sha.
+        With full, the update carries the whole image whatever the device is running."""
+        paths = self.images()
+        if not paths:
+            return 404, b""
+        latest_path = paths[-1]
+        with open(latest_path, "rb") as f:
+            latest = f.read()
+        if project and project_name(latest) != project:
+            return 404, b""
+        if elf_sha256(latest) == from_sha:
+            return 204, b""
+        key = (None if full else from_sha, latest_path, os.path.getmtime(latest_path))
+        if key not in self.deltas and full:
+            self.deltas[key] = make_full(latest, self.key)
+        if key not in self.deltas:
+            for path in paths:
+                with open(path, "rb") as f:
+                    old = f.read()
+                if elf_sha256(old) == from_sha:
+                    delta = make_delta(old, latest, self.key)
+                    apply_delta(old, delta)
+                    self.deltas[key] = delta
+                    print("Delta %s -> %s: %d bytes for a %d byte image (%d%%)" % (
+                        os.path.basename(path), os.path.basename(latest_path), len(delta), len(latest),
+                        len(delta) * 100 // len(latest)))
+                    break
+            else:
+                return 404, b""
+        return 200, self.deltas[key]
+
+
+def make_server(firmware, port):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            url = urllib.parse.urlparse(self.path)
+            query = urllib.parse.parse_qs(url.query)
+            if url.path == "/delta":
+                status, body = firmware.delta_from(query.get("project", [""])[0], query.get("from", [""])[0].lower(),
+                                                   query.get("full", ["0"])[0] == "1")
+            else:
+                status, body = 404, b""
+            self.send_response(status)
+            if status == 200:
+                self.send_header("Content-Type", "application/octet-stream")
+                self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            if status == 200:
+                self.wfile.write(body)
+
+    return http.server.ThreadingHTTPServer(("", port), Handler)
+
+
+def serve(args):
+    server = make_server(Firmware(args.directory, args.key), args.port)
+    print("Serving %s on port %d" % (args.directory, args.port))
+    server.serve_forever()
+
+
+def delta(args):
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+    result = make_delta(old, new, args.key)
+    apply_delta(old, result)
+    with open(args.out, "wb") as f:
+        f.write(result)
+    print("%d bytes for a %d byte image (%d%%)" % (len(result), len(new), len(result) * 100 // len(new)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Delta OTA update server for the Octopus unit rate display")
+    commands = parser.add_subparsers(dest="command", required=True)
+    p = commands.add_parser("keygen", help="make the signing key and the public key built into devices")
+    p.add_argument("--key", default=DEFAULT_KEY)
+    p.add_argument("--public-key", default=PUBLIC_KEY)
+    p.set_defaults(func=keygen)
+    p = commands.add_parser("serve", help="serve deltas to devices")
+    p.add_argument("directory")
+    p.add_argument("--port", type=int, default=8070)
+    p.add_argument("--key", default=DEFAULT_KEY)
+    p.set_defaults(func=serve)
+    p = commands.add_parser("delta", help="make a delta between two images")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("out")
+    p.add_argument("--key", default=DEFAULT_KEY)
+    p.set_defaults(func=delta)
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+#
+# Local stand-in for api.octopus.energy with injected delays
+#
+# Serves made-up rates in the same format as the Octopus API paths fetched by
+# get_unit_rates_task() in main/main.c, delaying each response so that slow fetches and
+# hedging can be tried out on a unit without waiting for the real API to be slow.
+# Point the Octopus API option at one instance with a slow tail and the hedge source at
+# another without, then compare the fetch latency logs with hedging on and off.
+#
+#   ./standin_server.py [--port 8080] [--delay-ms 100] [--slow-percent 10] [--slow-ms 8000]
+#
+# Agile products are those with AGILE in the product code, Flexible those with VAR;
+# anything else gets daily Tracker rates.
+
+import argparse
+import datetime
+import hashlib
+import json
+import random
+import re
+import sys
+import threading
+import time
+import http.server
+import urllib.parse
+
+REGIONS = "ABCDEFGHJKLMNP"
+UNIT_RATES_PATH = re.compile(r"^/v1/products/([^/]+)/(electricity|gas)-tariffs/([^/]+)/standard-unit-rates/$")
+PRODUCT_PATH = re.compile(r"^/v1/products/([^/]+)/$")
+
+
+def iso(t):
+    return t.strftime("%Y-%m-%dT%H:%M:%SZ")
+
+
+def parse_iso(s):
+    return datetime.datetime.strptime(s[:19], "%Y-%m-%dT%H:%M:%S").replace(tzinfo=datetime.timezone.utc)
+
+
+def rate(*key):
+    """A repeatable made-up rate in pence for the tariff and slot in key."""
+    digest = hashlib.sha256(repr(key).encode()).digest()
+    return round(10 + int.from_bytes(digest[:4], "little") % 2500 / 100, 2)
+
+
+def entry(value, valid_from, valid_to, payment_method=None):
+    return {"value_exc_vat": round(value / 1.05, 4), "value_inc_vat": value,
+            "valid_from": iso(valid_from), "valid_to": iso(valid_to) if valid_to else None,
+            "payment_method": payment_method}
+
+
+def unit_rates(product, fuel, tariff, now, tomorrow_published):
+    """Results newest first, as the API gives them."""
+    today = now.replace(hour=0, minute=0, second=0, microsecond=0)
+    day = datetime.timedelta(days=1)
+    results = []
+    if "AGILE" in product:
+        # Tomorrow's Agile prices are published in the afternoon
+        end = today + (2 * day if tomorrow_published and now.hour >= 16 else day)
+        slot = datetime.timedelta(minutes=30)
+        t = end - slot
+        while t >= today - day:
+            results.append(entry(rate(tariff, iso(t)), t, t + slot))
+            t -= slot
+    elif "VAR" in product:
+        start = today - 30 * day
+        results.append(entry(rate(tariff), start, None, "DIRECT_DEBIT"))
+        results.append(entry(rate(tariff) + 1, start, None, "NON_DIRECT_DEBIT"))
+    else:
+        end = today + (2 * day if tomorrow_published else day)
+        t = end - day
+        while t >= today - 30 * day:
+            results.append(entry(rate(tariff, iso(t)), t, t + day))
+            t -= day
+    return results
+
+
+def product_detail(product):
+    def tariffs(fuel):
+        return {"_" + region: {"direct_debit_monthly": {
+            "code": "%s-1R-%s-%s" % (fuel, product, region),
+            "standard_unit_rate_exc_vat": round(rate(product, fuel, region) / 1.05, 4),
+            "standard_unit_rate_inc_vat": rate(product, fuel, region),
+            "standing_charge_inc_vat": 40.0}} for region in REGIONS}
+    return {"code": product, "full_name": "Stand-in " + product, "is_variable": True,
+            "single_register_electricity_tariffs": tariffs("E"),
+            "single_register_gas_tariffs": tariffs("G")}
+
+
+def respond(path, query, now, tomorrow_published):
+    match = UNIT_RATES_PATH.match(path)
+    if match:
+        results = unit_rates(match.group(1), match.group(2), match.group(3), now, tomorrow_published)
+        if "period_from" in query:
+            period_from = parse_iso(query["period_from"][0])
+            results = [r for r in results if r["valid_to"] is None or parse_iso(r["valid_to"]) > period_from]
+        count = len(results)
+        if "page_size" in query:
+            results = results[:int(query["page_size"][0])]
+        return 200, {"count": count, "next": None, "previous": None, "results": results}
+    match = PRODUCT_PATH.match(path)
+    if match:
+        return 200, product_detail(match.group(1))
+    return 404, {"detail": "Not found."}
+
+
+class Delays:
+    """Picks a delay for each response and keeps the ones used for the summary."""
+
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.lock = threading.Lock()
+        self.served = []
+
+    def pick(self):
+        with self.lock:
+            if self.random.random() * 100 < self.args.slow_percent:
+                delay = self.args.slow_ms
+            else:
+                delay = self.args.delay_ms + self.random.random() * self.args.jitter_ms
+            self.served.append(delay)
+            return delay
+
+    def summary(self):
+        with self.lock:
+            served = sorted(self.served)
+        if not served:
+            return "no requests"
+        return "%d requests, delay p50 %d ms, p95 %d ms, max %d ms" % (
+            len(served), served[(len(served) - 1) * 50 // 100], served[(len(served) - 1) * 95 // 100], served[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for api.octopus.energy with injected delays")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--delay-ms", type=int, default=100, help="delay before every response")
+    parser.add_argument("--jitter-ms", type=int, default=50, help="random extra delay up to this")
+    parser.add_argument("--slow-percent", type=float, default=0, help="percentage of responses held for --slow-ms instead")
+    parser.add_argument("--slow-ms", type=int, default=8000)
+    parser.add_argument("--no-tomorrow", action="store_true", help="act as if tomorrow's rates aren't published yet")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    delays = Delays(args)
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            url = urllib.parse.urlparse(self.path)
+            now = datetime.datetime.now(datetime.timezone.utc)
+            status, body = respond(url.path, urllib.parse.parse_qs(url.query), now, not args.no_tomorrow)
+            body = json.dumps(body).encode()
+            delay = delays.pick()
+            time.sleep(delay / 1000)
+            self.send_response(status)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *log_args):
+            sys.stderr.write("%s %s\n" % (self.address_string(), format % log_args))
+
+    server = http.server.ThreadingHTTPServer(("", args.port), Handler)
+    print("Stand-in API on port %d: %d ms + up to %d ms, %g%% held for %d ms" % (
+        args.port, args.delay_ms, args.jitter_ms, args.slow_percent, args.slow_ms), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(delays.summary())
+
+
+if __name__ == "__main__":
+    sys.exit(main())